@@ -0,0 +1,172 @@
+// sample2.txt written for cpu_mem_asm: "cpu_mem_asm examples/sample2.asm" gives the same words
+
+main:
+        call lineOne
+        call lineTwo
+        call lineThree
+        call lineFour
+        call lineFive
+        call lineSix
+        call lineSeven
+        end
+
+CHAR = 2                        // Put port for characters
+
+lineOne:
+        load 4
+        push
+        call spaces
+        pop                     // remove parm
+        load 6
+        push
+        call dashes
+        pop
+        call newline
+        ret
+
+lineTwo:
+        load ' '
+        put CHAR
+        load '/'
+        put CHAR
+        load 9
+        push
+        call spaces
+        pop
+        load '\\'
+        put CHAR
+        call newline
+        ret
+
+lineThree:
+        load '/'
+        put CHAR
+        load ' '
+        put CHAR
+        put CHAR
+        put CHAR
+        call eye
+        load ' '
+        put CHAR
+        put CHAR
+        call eye
+        load ' '
+        put CHAR
+        put CHAR
+        load '\\'
+        put CHAR
+        call newline
+        ret
+
+lineFour:
+        load '|'
+        put CHAR
+        load 11
+        push
+        call spaces
+        pop
+        load '|'
+        put CHAR
+        call newline
+        ret
+
+lineFive:
+        load '\\'
+        put CHAR
+        load ' '
+        put CHAR
+        put CHAR
+        put CHAR
+        load '\\'
+        put CHAR
+        load 4
+        push
+        call underscores
+        pop
+        load '/'
+        put CHAR
+        load ' '
+        put CHAR
+        put CHAR
+        load '/'
+        put CHAR
+        call newline
+        ret
+
+lineSix:
+        load ' '
+        put CHAR
+        load '\\'
+        put CHAR
+        load 9
+        push
+        call spaces
+        pop
+        load '/'
+        put CHAR
+        call newline
+        ret
+
+lineSeven:
+        load 4
+        push
+        call spaces
+        pop
+        load 6
+        push
+        call dashes
+        pop
+        call newline
+        ret
+
+dashes:                         // print parm dashes
+        load 1
+        copytox
+        loadspx                 // get parm
+        copytox
+dash:   load '-'
+        put CHAR
+        decx
+        copyfromx
+        jumpifnotequal dash
+        ret
+
+underscores:                    // print parm underscores
+        load 1
+        copytox
+        loadspx
+        copytox
+underscore:
+        load '_'
+        put CHAR
+        decx
+        copyfromx
+        jumpifnotequal underscore
+        ret
+
+spaces:                         // print parm spaces
+        load 1
+        copytox
+        loadspx
+        copytox
+space:  load ' '
+        put CHAR
+        decx
+        copyfromx
+        jumpifnotequal space
+        ret
+
+newline:
+        load '\n'
+        put CHAR
+        ret
+
+eye:                            // print -*
+        load '-'
+        put CHAR
+        load '*'
+        put CHAR
+        ret
+
+.address 1000
+        iret                    // timer interrupt handler - just return
@@ -0,0 +1,795 @@
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu_mem_sim.h"
+#include "cpu_mem_instance.h"
+#include "cpu_mem_aot.h"
+
+/*
+ * Ahead-of-time translation
+ *
+ * User code reachable from address 0 becomes one C function with a label per basic block, working
+ * on registers in locals. A block runs only in user mode, with nothing pending, when it ends before
+ * the next timer tick and within the instruction budget, so interrupts and budgets land exactly
+ * where the interpreter would put them. Anything else (system code, syscalls, faults, random, block
+ * copies, the tick itself) goes back to the interpreter at the instruction it needs, and native code
+ * takes over again at the next block start. Once a run changes a translated word, the simulator
+ * interprets until its next reset.
+ */
+
+#ifdef CPU_MEM_AOT
+/**
+ * main
+ *
+ * Translates a program's user code into C, and with -o compiles it into a shared object with the
+ * host compiler ($CC, or cc). With -r, the program runs as a simulator instance on the translation
+ * from -o or -l (or interpreted, with neither), and a run report goes to stderr.
+ *
+ * Usage: cpu_mem_aot [-c file.c] [-o file.so | -l file.so] [-r] [-i interrupt] program
+ *
+ * Build: gcc -O2 -DCPU_MEM_AOT -o cpu_mem_aot src/C/cpu_mem_aot.c src/C/cpu_mem_instance.c
+ *            src/C/cpu_mem_sim.c -ldl
+ *
+ * @param argc holds count for command line arguments
+ * @param argv holds values from command line entries
+ */
+int main(int argc, char **argv) {
+    int option;
+    char const *sourceFile = NULL;
+    char const *objectFile = NULL;
+    char const *loadFile = NULL;
+    bool run = false;
+    int interrupt = 10000;
+
+    while ((option = getopt(argc, argv, "c:o:l:ri:")) != -1) {
+        switch (option) {
+            case 'c':
+                sourceFile = optarg;
+                break;
+            case 'o':
+                objectFile = optarg;
+                break;
+            case 'l':
+                loadFile = optarg;
+                break;
+            case 'r':
+                run = true;
+                break;
+            case 'i':
+                interrupt = atoi(optarg);
+                break;
+            default:
+                errorExit("unknown option");
+        }
+    }
+
+    if (optind != argc - 1)
+        errorExit("wrong number of arguments");
+
+    if (interrupt <= 0)
+        errorExit("interrupt must be a positive number");
+
+    if (objectFile != NULL && loadFile != NULL)
+        errorExit("-o and -l both give the translation to run");
+
+    Word image[PARTITION_WORDS] = { 0 };
+    validateFile(image, argv[optind]);
+
+    if (sourceFile != NULL || objectFile != NULL) {
+        // without -c, the C goes to a temporary file that only the compiler reads
+        char tempName[] = "/tmp/cpu_mem_aot_XXXXXX.c";
+        FILE *fp;
+        if (sourceFile != NULL) {
+            fp = fopen(sourceFile, "w");
+        }
+        else {
+            int fd = mkstemps(tempName, 2);
+            fp = (fd >= 0) ? fdopen(fd, "w") : NULL;
+        }
+        if (fp == NULL)
+            errorExit("C file failed to open");
+
+        char *error = translateProgram(image, argv[optind], fp);
+        if (fclose(fp) != 0 && error == NULL)
+            error = "C file failed to write";
+        if (error != NULL)
+            errorExit(error);
+
+        bool compiled = (objectFile == NULL) || compileTranslation(sourceFile != NULL ? sourceFile : tempName, objectFile);
+        if (sourceFile == NULL)
+            unlink(tempName);
+        if (!compiled)
+            errorExit("compiler failed");
+
+        loadFile = objectFile;
+    }
+
+    if (!run)
+        return 0;
+
+    Simulator *simulator = createSimulator(image, interrupt);
+    if (simulator == NULL)
+        errorExit("malloc() failed");
+    simulator->outputFunction = showTranslatedOutput;
+
+    Translation translation;
+    if (loadFile != NULL) {
+        char *error = loadTranslation(loadFile, &translation);
+        if (error == NULL)
+            error = attachTranslation(simulator, &translation);
+        if (error != NULL)
+            errorExit(error);
+    }
+
+    RunStatus status = runSimulator(simulator, 0);
+    fflush(stdout);
+    printRunReport(status, &simulator->metrics);
+
+    destroySimulator(simulator);
+    if (loadFile != NULL)
+        freeTranslation(&translation);
+    return (status == RUN_FINISHED) ? 0 : 1;
+} /* end main */
+#endif
+
+/**
+ * Compiles generated C into a shared object with the host compiler ($CC names it, default cc)
+ *
+ * @param sourceFile generated C
+ * @param objectFile shared object to write
+ * @return true if the compiler succeeded
+ */
+bool compileTranslation(char const *sourceFile, char const *objectFile) {
+    char const *compiler = getenv("CC");
+    if (compiler == NULL || compiler[0] == '\0')
+        compiler = "cc";
+
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+
+    if (pid == 0) {
+        execlp(compiler, compiler, "-O2", "-fPIC", "-shared", "-o", objectFile, sourceFile, (char *)NULL);
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+} /* end */
+
+/**
+ * Checks whether a run changed a word its translation was made from
+ * Only pages written since the last reset can differ from the loaded image
+ *
+ * @param simulator instance with a translation attached
+ * @return true or false
+ */
+bool isCodeChanged(Simulator const *simulator) {
+    unsigned char const *code = simulator->translation->code;
+    for (int i = 0; i < SIMULATOR_DIRTY_WORDS; i++) {
+        unsigned int bits = simulator->dirtyPages[i];
+        while (bits != 0) {
+            int first = (i * 32 + __builtin_ctz(bits)) * PAGE_WORDS;
+            int last = (first + PAGE_WORDS <= PARTITION_WORDS) ? first + PAGE_WORDS : PARTITION_WORDS;
+            for (int address = first; address < last; address++) {
+                if (code[address] && simulator->image[address] != simulator->base[address])
+                    return true;
+            }
+            bits &= bits - 1;
+        }
+    }
+    return false;
+} /* end */
+
+/**
+ * Confirms an instruction runs as native code; the rest (random, syscalls, interrupt returns,
+ * block copies, end, and invalid opcodes) are left to the interpreter
+ *
+ * @param IR instruction
+ * @return true or false
+ */
+bool isTranslatedOpcode(Word IR) {
+    return (IR >= 1 && IR <= 28 && IR != 8) || (IR >= 31 && IR <= 42);
+} /* end */
+
+/**
+ * Finds the instructions of the block that starts at an address: it ends after a jump, call or
+ * return, before an instruction that isn't translated or would fault on its operand, or before
+ * the next block start
+ *
+ * @param image program
+ * @param start block start, a user address
+ * @param blockStarts block starts found so far
+ * @param addresses set to the address of each instruction
+ * @return instructions in the block (0 if the one at start isn't translated)
+ */
+int findTranslatedBlock(Word const *image, int start, unsigned char const *blockStarts, int *addresses) {
+    int const last = getMaxUserProgramEntry();
+    int count = 0;
+
+    for (int address = start; address <= last && (address == start || !blockStarts[address]); ) {
+        Word IR = image[address];
+        int words = instructionWords(IR);
+        if (!isTranslatedOpcode(IR) || address + words - 1 > last)
+            break;
+
+        // loads and stores from a bad operand address fault; the interpreter raises it
+        Word operand = (words == 2) ? image[address + 1] : 0;
+        if ((IR == 2 || IR == 3 || IR == 7) && !validateAddressAccess(operand, false))
+            break;
+
+        addresses[count++] = address;
+        if (IR >= 20 && IR <= 24)
+            break;
+        address += words;
+    }
+    return count;
+} /* end */
+
+/**
+ * Hashes a loaded image (FNV-1a over words), so a translation is only run on its own program
+ *
+ * @param image PARTITION_WORDS words
+ * @return hash
+ */
+uint64_t hashImage(Word const *image) {
+    uint64_t hash = 14695981039346656037u;
+    for (int i = 0; i < PARTITION_WORDS; i++) {
+        hash ^= (uint64_t)(UWord)image[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+} /* end */
+
+/**
+ * Runs a simulator with its translation: native code runs user blocks while it can, and the
+ * interpreter runs up to the next block start where it can again
+ *
+ * The simulator has no vector table, so output raises a device interrupt that stays masked, and
+ * native code never has to take an interrupt
+ *
+ * @param simulator instance with a translation attached
+ * @param instructions most instructions to run, 0 for no limit
+ * @return how the run ended, as runSimulator would return it
+ */
+RunStatus runTranslation(Simulator *simulator, long instructions) {
+    Translation const *translation = simulator->translation;
+    ProcessControlBlock *process = &simulator->process;
+    InterruptController *controller = &simulator->controller;
+    Metrics total = { 0 };
+    RunStatus status = RUN_FINISHED;
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    TranslationState state;
+    state.memory = simulator->image;
+    state.dirtyPages = simulator->dirtyPages;
+    state.output = translatedOutput;
+    state.outputContext = simulator;
+
+    while (simulator->scheduler.liveCount > 0) {
+        long left = (instructions > 0) ? instructions - total.instructions : LONG_MAX;
+        if (left == 0) {
+            status = RUN_INSTRUCTION_LIMIT;
+            break;
+        }
+
+        // native code stops one instruction short of the next tick
+        if (!simulator->translationStale && !process->kernelMode) {
+            loadInterruptMask(controller, &simulator->bus);
+            long tickRoom = (process->timer / simulator->interrupt + 1) * simulator->interrupt - process->timer - 1;
+
+            if (!(controller->pending & controller->enabled) && tickRoom > 0) {
+                state.PC = process->PC;
+                state.SP = process->SP;
+                state.AC = process->AC;
+                state.X = process->X;
+                state.Y = process->Y;
+                state.room = (left < tickRoom) ? left : tickRoom;
+                state.reads = 0;
+                state.writes = 0;
+
+                long room = state.room;
+                translation->run(&state);
+                long ran = room - state.room;
+
+                process->PC = state.PC;
+                process->SP = state.SP;
+                process->AC = state.AC;
+                process->X = state.X;
+                process->Y = state.Y;
+                process->timer += ran;
+                total.instructions += ran;
+                total.memoryReads += state.reads;
+                total.memoryWrites += state.writes;
+                if (ran == left) {
+                    status = RUN_INSTRUCTION_LIMIT;
+                    break;
+                }
+                left -= ran;
+            }
+        }
+
+        // the process left the ready queue when the last interpreted run picked it
+        if (simulator->scheduler.readyLevels == 0)
+            enqueueProcess(&simulator->scheduler, 0);
+
+        simulator->limits.instructions = (left == LONG_MAX) ? 0 : left;
+        simulator->limits.stopPoints = simulator->translationStale ? NULL : translation->blockStarts;
+        status = cpuProcess(&simulator->bus, simulator->interrupt, &simulator->scheduler, controller,
+                            &simulator->limits, &simulator->metrics, NULL, NULL);
+        mergeMetrics(&total, &simulator->metrics);
+
+        // a store the interpreter ran may have changed translated code
+        if (!simulator->translationStale && simulator->metrics.memoryWrites > 0)
+            simulator->translationStale = isCodeChanged(simulator);
+
+        // a stop point returns as an instruction limit, so the budget tells the two apart
+        if (status != RUN_INSTRUCTION_LIMIT)
+            break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    total.elapsedNs = elapsedNanoseconds(&started, &finished);
+    simulator->limits.stopPoints = NULL;
+    simulator->metrics = total;
+    return status;
+} /* end */
+
+/**
+ * Attaches a translation to a simulator (or detaches one), if it was made from the loaded image
+ *
+ * @param simulator instance
+ * @param translation loaded translation, NULL to interpret again
+ * @return error message, or NULL once attached
+ */
+char *attachTranslation(Simulator *simulator, Translation const *translation) {
+    if (translation != NULL && hashImage(simulator->base) != translation->imageHash)
+        return "translation is of another program";
+
+    simulator->translation = translation;
+    simulator->translationStale = (translation != NULL) && isCodeChanged(simulator);
+    return NULL;
+} /* end */
+
+/**
+ * Loads a shared object written by translateProgram and compileTranslation
+ *
+ * @param fileName shared object (a name without a slash is taken from the current directory)
+ * @param translation set to the loaded translation
+ * @return error message, or NULL once loaded
+ */
+char *loadTranslation(char const *fileName, Translation *translation) {
+    // dlopen searches the library path for a bare name
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s%s", strchr(fileName, '/') != NULL ? "" : "./", fileName) >= (int)sizeof(path))
+        return "translation path too long";
+
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL)
+        return dlerror();
+
+    int const *wordBits = dlsym(handle, "translatedWordBits");
+    uint64_t const *imageHash = dlsym(handle, "translatedImageHash");
+    translation->blockStarts = dlsym(handle, "translatedBlockStarts");
+    translation->code = dlsym(handle, "translatedCode");
+    *(void **)&translation->run = dlsym(handle, "translatedRun");
+
+    char *error = NULL;
+    if (wordBits == NULL || imageHash == NULL || translation->blockStarts == NULL || translation->code == NULL ||
+        translation->run == NULL)
+        error = "not a translation";
+    else if (*wordBits != WORD_BITS)
+        error = "translation is for another word width";
+
+    if (error != NULL) {
+        dlclose(handle);
+        return error;
+    }
+
+    translation->handle = handle;
+    translation->imageHash = *imageHash;
+    return NULL;
+} /* end */
+
+/**
+ * Writes a program's user code as C: registers in locals, a switch from PC to block labels, and
+ * maps of block starts and translated words for the runner
+ *
+ * @param image program, as loaded
+ * @param source program file name, for the header comment
+ * @param out C file
+ * @return error message, or NULL once written
+ */
+char *translateProgram(Word const *image, char const *source, FILE *out) {
+    unsigned char blockStarts[PARTITION_WORDS];
+    unsigned char code[PARTITION_WORDS];
+    findBlockStarts(image, blockStarts, code);
+
+    fprintf(out, "/* %s, translated by cpu_mem_aot; do not edit */\n", source);
+    fprintf(out, "#include <stdint.h>\n\n");
+    fprintf(out, "typedef int%d_t Word;\ntypedef uint%d_t UWord;\n\n", WORD_BITS, WORD_BITS);
+    fprintf(out, "#define WORD_ADD(a, b) ((Word)((UWord)(a) + (UWord)(b)))\n");
+    fprintf(out, "#define WORD_SUB(a, b) ((Word)((UWord)(a) - (UWord)(b)))\n");
+    fprintf(out, "#define WORD_MUL(a, b) ((Word)((UWord)(a) * (UWord)(b)))\n");
+    fprintf(out, "#define DIRTY(a) (s->dirtyPages[(a) / %d / 32] |= 1u << ((a) / %d %% 32))\n", PAGE_WORDS, PAGE_WORDS);
+    fprintf(out, "#define EXIT(address, left) do { PC = (address); room += (left); goto leave; } while (0)\n\n");
+    fprintf(out, "typedef struct TranslationState { %s } TranslationState;\n\n", TRANSLATION_TEXT(TRANSLATION_STATE_FIELDS));
+
+    fprintf(out, "int const translatedWordBits = %d;\n", WORD_BITS);
+    fprintf(out, "uint64_t const translatedImageHash = UINT64_C(%#" PRIx64 ");\n", hashImage(image));
+
+    char const *names[2] = { "translatedBlockStarts", "translatedCode" };
+    unsigned char const *maps[2] = { blockStarts, code };
+    for (int i = 0; i < 2; i++) {
+        fprintf(out, "unsigned char const %s[%d] = {", names[i], PARTITION_WORDS);
+        int written = 0;
+        for (int address = 0; address < PARTITION_WORDS; address++) {
+            if (maps[i][address])
+                fprintf(out, "%s[%d] = 1,", (written++ % 10 == 0) ? "\n    " : " ", address);
+        }
+        fprintf(out, "\n};\n");
+    }
+
+    fprintf(out, "\nvoid translatedRun(TranslationState *s) {\n");
+    fprintf(out, "    Word PC = s->PC, SP = s->SP, AC = s->AC, X = s->X, Y = s->Y;\n");
+    fprintf(out, "    Word *M = s->memory;\n");
+    fprintf(out, "    Word t;\n");
+    fprintf(out, "    long room = s->room, reads = 0, writes = 0;\n\n");
+    fprintf(out, "dispatch:\n    switch (PC) {\n");
+    for (int address = 0; address < PARTITION_WORDS; address++) {
+        if (blockStarts[address])
+            fprintf(out, "    case %d: goto b%d;\n", address, address);
+    }
+    fprintf(out, "    default: goto leave;\n    }\n\n");
+
+    for (int address = 0; address < PARTITION_WORDS; address++) {
+        if (blockStarts[address])
+            writeTranslatedBlock(out, image, address, blockStarts, code);
+    }
+
+    fprintf(out, "leave:\n");
+    fprintf(out, "    s->PC = PC;\n    s->SP = SP;\n    s->AC = AC;\n    s->X = X;\n    s->Y = Y;\n");
+    fprintf(out, "    s->room = room;\n    s->reads = reads;\n    s->writes = writes;\n}\n");
+
+    return ferror(out) ? "C file failed to write" : NULL;
+} /* end */
+
+/**
+ * Finds the blocks reachable from address 0: jump and call targets, the instruction after a call
+ * or conditional jump, and the instruction after one the interpreter runs and then continues past
+ *
+ * @param image program
+ * @param blockStarts set for each block start
+ * @param code set for each word of a translated instruction
+ */
+void findBlockStarts(Word const *image, unsigned char *blockStarts, unsigned char *code) {
+    int work[PARTITION_WORDS];
+    int addresses[PARTITION_WORDS];
+    int count = 0;
+
+    memset(blockStarts, 0, PARTITION_WORDS);
+    memset(code, 0, PARTITION_WORDS);
+    blockStarts[0] = 1;
+    work[count++] = 0;
+
+    while (count > 0) {
+        int start = work[--count];
+        int length = findTranslatedBlock(image, start, blockStarts, addresses);
+
+        Word targets[3];
+        int targetCount = 0;
+        for (int i = 0; i < length; i++) {
+            int address = addresses[i];
+            Word IR = image[address];
+            memset(code + address, 1, instructionWords(IR));
+
+            if (IR >= 20 && IR <= 23)
+                targets[targetCount++] = image[address + 1];
+            if (IR >= 21 && IR <= 23)
+                targets[targetCount++] = address + 2;
+        }
+
+        // random, a syscall (its handler returns after it), or a block copy
+        int next = (length > 0) ? addresses[length - 1] + instructionWords(image[addresses[length - 1]]) : start;
+        if (validateAddressAccess(next, false)) {
+            Word IR = image[next];
+            if (IR == 8 || IR == 29 || IR == 43 || IR == 44)
+                targets[targetCount++] = next + 1;
+        }
+
+        for (int i = 0; i < targetCount; i++) {
+            if (validateAddressAccess(targets[i], false) && !blockStarts[targets[i]]) {
+                blockStarts[targets[i]] = 1;
+                work[count++] = targets[i];
+            }
+        }
+    }
+} /* end */
+
+/**
+ * Releases a loaded translation; no simulator may still have it attached
+ *
+ * @param translation loaded translation
+ */
+void freeTranslation(Translation *translation) {
+    dlclose(translation->handle);
+    translation->handle = NULL;
+} /* end */
+
+/**
+ * Prints guest output as the command line simulator does
+ *
+ * @param context unused
+ * @param port 1 for an int, 2 for a char
+ * @param value value to output
+ */
+void showTranslatedOutput(void *context, int port, int64_t value) {
+    (void)context;
+    showAC(port, value);
+} /* end */
+
+/**
+ * Outputs AC for native code, and raises the device interrupt as the interpreter does
+ *
+ * @param context the simulator
+ * @param port from the instruction
+ * @param AC value to output
+ */
+void translatedOutput(void *context, Word port, Word AC) {
+    Simulator *simulator = context;
+    simulator->bus.output(simulator->bus.outputContext, port, AC);
+    raiseInterrupt(&simulator->controller, IRQ_DEVICE);
+} /* end */
+
+/**
+ * Writes one block: its room check, its instructions, and where it goes next
+ *
+ * @param out C file
+ * @param image program
+ * @param start block start
+ * @param blockStarts every block start
+ * @param code translated words
+ */
+void writeTranslatedBlock(FILE *out, Word const *image, int start, unsigned char const *blockStarts,
+                          unsigned char const *code) {
+    int addresses[PARTITION_WORDS];
+    int length = findTranslatedBlock(image, start, blockStarts, addresses);
+
+    fprintf(out, "b%d:\n", start);
+    if (length == 0) {
+        fprintf(out, "    PC = %d;\n    goto leave;\n\n", start);
+        return;
+    }
+
+    fprintf(out, "    if (room < %d) {\n        PC = %d;\n        goto leave;\n    }\n", length, start);
+    fprintf(out, "    room -= %d;\n", length);
+    for (int i = 0; i < length; i++)
+        writeTranslatedInstruction(out, image, addresses[i], length - i, blockStarts, code);
+
+    // a block that doesn't end in a jump runs into the next block, or the interpreter
+    int last = addresses[length - 1];
+    if (image[last] < 20 || image[last] > 24) {
+        fprintf(out, "    ");
+        writeTranslatedJump(out, last + instructionWords(image[last]), blockStarts);
+    }
+    fprintf(out, "\n");
+} /* end */
+
+/**
+ * Writes one instruction; a fault, a divide by zero, or a store into translated code leaves for
+ * the interpreter with PC at the instruction and its room given back, so it runs it over
+ *
+ * @param out C file
+ * @param image program
+ * @param address instruction address
+ * @param left instructions from this one to the end of its block
+ * @param blockStarts every block start
+ * @param code translated words
+ */
+void writeTranslatedInstruction(FILE *out, Word const *image, int address, int left,
+                                unsigned char const *blockStarts, unsigned char const *code) {
+    int const last = getMaxUserProgramEntry();
+    Word IR = image[address];
+    Word operand = (instructionWords(IR) == 2) ? image[address + 1] : 0;
+
+    char exit[64];
+    snprintf(exit, sizeof(exit), "EXIT(%d, %d);", address, left);
+
+    fprintf(out, "    /* %d: " WORD_FORMAT, address, IR);
+    if (instructionWords(IR) == 2)
+        fprintf(out, " " WORD_FORMAT, operand);
+    fprintf(out, " */\n");
+
+    switch (IR) {
+        case 1:
+            fprintf(out, "    AC = ");
+            writeTranslatedWord(out, operand);
+            fprintf(out, ";\n    reads += 2;\n");
+            break;
+
+        case 2:
+            fprintf(out, "    AC = M[" WORD_FORMAT "];\n    reads += 3;\n", operand);
+            break;
+
+        case 3:
+            fprintf(out, "    t = M[" WORD_FORMAT "];\n", operand);
+            fprintf(out, "    if ((UWord)t > %d)\n        %s\n", last, exit);
+            fprintf(out, "    AC = M[t];\n    reads += 4;\n");
+            break;
+
+        case 4:
+        case 5:
+            fprintf(out, "    t = WORD_ADD(");
+            writeTranslatedWord(out, operand);
+            fprintf(out, ", %s);\n", (IR == 4) ? "X" : "Y");
+            fprintf(out, "    if ((UWord)t > %d)\n        %s\n", last, exit);
+            fprintf(out, "    AC = M[t];\n    reads += 3;\n");
+            break;
+
+        case 6:
+            fprintf(out, "    t = WORD_ADD(SP, X);\n");
+            fprintf(out, "    if ((UWord)t > %d)\n        %s\n", last, exit);
+            fprintf(out, "    AC = M[t];\n    reads += 2;\n");
+            break;
+
+        case 7:
+            if (code[operand]) {
+                fprintf(out, "    %s\n", exit);
+                break;
+            }
+            fprintf(out, "    M[" WORD_FORMAT "] = AC;\n", operand);
+            fprintf(out, "    s->dirtyPages[%d] |= %uu;\n", (int)(operand / PAGE_WORDS / 32), 1u << (operand / PAGE_WORDS % 32));
+            fprintf(out, "    reads += 2;\n    writes += 1;\n");
+            break;
+
+        case 9:
+            fprintf(out, "    s->output(s->outputContext, ");
+            writeTranslatedWord(out, operand);
+            fprintf(out, ", AC);\n    reads += 2;\n");
+            break;
+
+        case 10:
+        case 11:
+        case 12:
+        case 13:
+            fprintf(out, "    AC = WORD_%s(AC, %s);\n    reads += 1;\n", (IR <= 11) ? "ADD" : "SUB", (IR % 2 == 0) ? "X" : "Y");
+            break;
+
+        case 14:
+        case 15:
+        case 16:
+        case 17:
+        case 18:
+        case 19: {
+            char const *copies[6] = { "X = AC", "AC = X", "Y = AC", "AC = Y", "SP = AC", "AC = SP" };
+            fprintf(out, "    %s;\n    reads += 1;\n", copies[IR - 14]);
+            break;
+        }
+
+        case 20:
+            fprintf(out, "    reads += 2;\n    ");
+            writeTranslatedJump(out, operand, blockStarts);
+            break;
+
+        case 21:
+        case 22:
+            fprintf(out, "    if (AC %s 0) {\n        reads += 2;\n        ", (IR == 21) ? "==" : "!=");
+            writeTranslatedJump(out, operand, blockStarts);
+            fprintf(out, "    }\n    reads += 1;\n    ");
+            writeTranslatedJump(out, address + 2, blockStarts);
+            break;
+
+        case 23:
+            fprintf(out, "    t = WORD_SUB(SP, 1);\n");
+            fprintf(out, "    if ((UWord)t > %d || translatedCode[t])\n        %s\n", last, exit);
+            fprintf(out, "    M[t] = %d;\n    DIRTY(t);\n    SP = t;\n", address + 1);
+            fprintf(out, "    reads += 2;\n    writes += 1;\n    ");
+            writeTranslatedJump(out, operand, blockStarts);
+            break;
+
+        case 24:
+            fprintf(out, "    if ((UWord)SP > %d)\n        %s\n", last, exit);
+            fprintf(out, "    PC = WORD_ADD(M[SP], 1);\n    SP = WORD_ADD(SP, 1);\n");
+            fprintf(out, "    reads += 2;\n    goto dispatch;\n");
+            break;
+
+        case 25:
+        case 26:
+            fprintf(out, "    X = WORD_%s(X, 1);\n    reads += 1;\n", (IR == 25) ? "ADD" : "SUB");
+            break;
+
+        case 27:
+            fprintf(out, "    t = WORD_SUB(SP, 1);\n");
+            fprintf(out, "    if ((UWord)t > %d || translatedCode[t])\n        %s\n", last, exit);
+            fprintf(out, "    M[t] = AC;\n    DIRTY(t);\n    SP = t;\n");
+            fprintf(out, "    reads += 1;\n    writes += 1;\n");
+            break;
+
+        case 28:
+            fprintf(out, "    if ((UWord)SP > %d)\n        %s\n", last, exit);
+            fprintf(out, "    AC = M[SP];\n    SP = WORD_ADD(SP, 1);\n    reads += 2;\n");
+            break;
+
+        case 31:
+        case 32:
+            fprintf(out, "    AC = WORD_MUL(AC, %s);\n    reads += 1;\n", (IR == 31) ? "X" : "Y");
+            break;
+
+        case 33:
+        case 34:
+        case 35:
+        case 36: {
+            char const *divisor = (IR % 2 == 1) ? "X" : "Y";
+            fprintf(out, "    if (%s == 0)\n        %s\n", divisor, exit);
+            if (IR <= 34)
+                fprintf(out, "    AC = (%s == -1) ? WORD_SUB(0, AC) : AC / %s;\n", divisor, divisor);
+            else
+                fprintf(out, "    AC = (%s == -1) ? 0 : AC %% %s;\n", divisor, divisor);
+            fprintf(out, "    reads += 1;\n");
+            break;
+        }
+
+        case 37:
+            fprintf(out, "    AC = (Word)((UWord)AC << %d);\n    reads += 2;\n", (int)(operand & (WORD_BITS - 1)));
+            break;
+
+        case 38:
+            fprintf(out, "    AC >>= %d;\n    reads += 2;\n", (int)(operand & (WORD_BITS - 1)));
+            break;
+
+        case 39:
+        case 40:
+        case 41: {
+            char const *operators[3] = { "&", "|", "^" };
+            fprintf(out, "    AC %s= X;\n    reads += 1;\n", operators[IR - 39]);
+            break;
+        }
+
+        case 42:
+            fprintf(out, "    AC = ~AC;\n    reads += 1;\n");
+            break;
+    }
+} /* end */
+
+/**
+ * Writes a jump: straight to a block label, or out to the interpreter with PC set
+ *
+ * @param out C file
+ * @param target address to go to
+ * @param blockStarts every block start
+ */
+void writeTranslatedJump(FILE *out, Word target, unsigned char const *blockStarts) {
+    if (validateAddressAccess(target, false) && blockStarts[target]) {
+        fprintf(out, "goto b" WORD_FORMAT ";\n", target);
+        return;
+    }
+
+    fprintf(out, "{ PC = ");
+    writeTranslatedWord(out, target);
+    fprintf(out, "; goto leave; }\n");
+} /* end */
+
+/**
+ * Writes a word as a C constant; negative words go through UWord, so the most negative one works
+ *
+ * @param out C file
+ * @param value word
+ */
+void writeTranslatedWord(FILE *out, Word value) {
+    if (value >= 0)
+        fprintf(out, WORD_FORMAT, value);
+    else
+        fprintf(out, "(Word)(UWord)%" PRIu64 "u", (uint64_t)(UWord)value);
+} /* end */
@@ -0,0 +1,60 @@
+#ifndef CPU_MEM_AOT_H_
+#define CPU_MEM_AOT_H_
+
+// registers and budget handed to translated code; the generated file declares the same struct
+// from this text, so the two can't drift apart
+#define TRANSLATION_STATE_FIELDS \
+    Word PC, SP, AC, X, Y; \
+    Word *memory; \
+    unsigned int *dirtyPages; \
+    long room; \
+    long reads, writes; \
+    void (*output)(void *context, Word port, Word AC); \
+    void *outputContext;
+
+#define TRANSLATION_STRING(...) #__VA_ARGS__
+#define TRANSLATION_TEXT(...) TRANSLATION_STRING(__VA_ARGS__)
+
+// room is how many instructions native code may run; it only runs a block that fits whole
+typedef struct TranslationState {
+    TRANSLATION_STATE_FIELDS
+} TranslationState;
+
+typedef void (*TranslatedRun)(TranslationState *state);
+
+// a translated program, loaded from its shared object: block starts are where native code can
+// take over from the interpreter, and code marks the words the translation was made from
+typedef struct Translation {
+    void *handle;
+    TranslatedRun run;
+    unsigned char const *blockStarts;
+    unsigned char const *code;
+    uint64_t imageHash;
+} Translation;
+
+bool compileTranslation(char const *sourceFile, char const *objectFile);
+bool isCodeChanged(Simulator const *simulator);
+bool isTranslatedOpcode(Word IR);
+
+int findTranslatedBlock(Word const *image, int start, unsigned char const *blockStarts, int *addresses);
+
+uint64_t hashImage(Word const *image);
+
+RunStatus runTranslation(Simulator *simulator, long instructions);
+
+char *attachTranslation(Simulator *simulator, Translation const *translation);
+char *loadTranslation(char const *fileName, Translation *translation);
+char *translateProgram(Word const *image, char const *source, FILE *out);
+
+void findBlockStarts(Word const *image, unsigned char *blockStarts, unsigned char *code);
+void freeTranslation(Translation *translation);
+void showTranslatedOutput(void *context, int port, int64_t value);
+void translatedOutput(void *context, Word port, Word AC);
+void writeTranslatedBlock(FILE *out, Word const *image, int start, unsigned char const *blockStarts,
+                          unsigned char const *code);
+void writeTranslatedInstruction(FILE *out, Word const *image, int address, int left,
+                                unsigned char const *blockStarts, unsigned char const *code);
+void writeTranslatedJump(FILE *out, Word target, unsigned char const *blockStarts);
+void writeTranslatedWord(FILE *out, Word value);
+
+#endif
@@ -0,0 +1,852 @@
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu_mem_sim.h"
+#include "cpu_mem_asm.h"
+
+static AsmOpcode const opcodes[] = {
+    { "load", 1, true },          { "loadaddr", 2, true },      { "loadind", 3, true },
+    { "loadidxx", 4, true },      { "loadidxy", 5, true },      { "loadspx", 6, false },
+    { "store", 7, true },         { "get", 8, false },          { "put", 9, true },
+    { "addx", 10, false },        { "addy", 11, false },        { "subx", 12, false },
+    { "suby", 13, false },        { "copytox", 14, false },     { "copyfromx", 15, false },
+    { "copytoy", 16, false },     { "copyfromy", 17, false },   { "copytosp", 18, false },
+    { "copyfromsp", 19, false },  { "jump", 20, true },         { "jumpifequal", 21, true },
+    { "jumpifnotequal", 22, true }, { "call", 23, true },       { "ret", 24, false },
+    { "incx", 25, false },        { "decx", 26, false },        { "push", 27, false },
+    { "pop", 28, false },         { "int", 29, false },         { "iret", 30, false },
+    { "mulx", 31, false },        { "muly", 32, false },        { "divx", 33, false },
+    { "divy", 34, false },        { "modx", 35, false },        { "mody", 36, false },
+    { "shiftleft", 37, true },    { "shiftright", 38, true },   { "andx", 39, false },
+    { "orx", 40, false },         { "xorx", 41, false },        { "not", 42, false },
+    { "copyblock", 43, false },   { "fillblock", 44, false },   { "end", 50, false }
+};
+
+static int const opcodeCount = sizeof(opcodes) / sizeof(opcodes[0]);
+
+/**
+ * main
+ *
+ * Assembles one source file into the text format the simulator loads (default)
+ * or a binary image (-b).
+ *
+ * Usage: cpu_mem_asm [-O] [-b] [-o output] file
+ *
+ * @param argc holds count for command line arguments
+ * @param argv holds values from command line entries
+ */
+int main(int argc, char **argv) {
+    int option;
+    bool optimize = false;
+    bool binary = false;
+    char const *outputName = NULL;
+
+    while ((option = getopt(argc, argv, "Obo:")) != -1) {
+        switch (option) {
+            case 'O':
+                optimize = true;
+                break;
+            case 'b':
+                binary = true;
+                break;
+            case 'o':
+                outputName = optarg;
+                break;
+            default:
+                errorExit("unknown option");
+        }
+    }
+
+    if (argc - optind != 1)
+        errorExit("wrong number of arguments");
+
+    Assembler assembler;
+    memset(&assembler, 0, sizeof(assembler));
+    assembler.fileName = argv[optind];
+
+    FILE *input = fopen(assembler.fileName, "r");
+    if (input == NULL)
+        errorExit("File failed to open");
+    assembleFile(&assembler, input);
+    fclose(input);
+
+    layoutProgram(&assembler);
+    if (optimize)
+        optimizeProgram(&assembler);
+
+    FILE *output = stdout;
+    if (outputName != NULL && (output = fopen(outputName, binary ? "wb" : "w")) == NULL)
+        errorExit("output file failed to open");
+
+    if (binary)
+        writeImage(&assembler, output);
+    else
+        writeText(&assembler, output);
+
+    if (output != stdout)
+        fclose(output);
+
+    for (int i = 0; i < assembler.segmentCount; i++)
+        free(assembler.segments[i].items);
+    free(assembler.segments);
+    free(assembler.symbols);
+    free(assembler.items);
+    return 0;
+} /* end main */
+
+/**
+ * Checks if an instruction's operand is an address (rather than a value or port)
+ *
+ * @param opcode instruction
+ * @return true or false
+ */
+bool hasAddressOperand(int opcode) {
+    return (opcode >= 2 && opcode <= 5) || opcode == 7 || (opcode >= 20 && opcode <= 23);
+} /* end */
+
+/**
+ * Checks if an instruction never continues with the next word
+ *
+ * @param opcode instruction
+ * @return true or false
+ */
+bool isBlockEnd(int opcode) {
+    return opcode == 20 || opcode == 24 || opcode == 30 || opcode == 50;
+} /* end */
+
+/**
+ * Checks if a segment's code may move, i.e. no numeric address operand anywhere points into it
+ * Symbolic operands follow their labels, so only numbers pin code in place
+ *
+ * @param assembler program, already laid out
+ * @param segment to check
+ * @return true or false
+ */
+bool isRelocatable(Assembler *assembler, AsmSegment *segment) {
+    int const first = segment->address;
+    int const last = assembler->items[segment->items[segment->count - 1]].address;
+
+    for (int i = 0; i < assembler->itemCount; i++) {
+        AsmItem const *item = &assembler->items[i];
+        if (item->opcode < 0 || !hasAddressOperand(item->opcode))
+            continue;
+
+        char const *operand = item->operand;
+        if (isalpha((unsigned char)operand[0]) || operand[0] == '_')
+            continue;
+
+        Word target = evaluateOperand(assembler, operand, item->line, false);
+        if (target >= first && target < last)
+            return false;
+    }
+    return true;
+} /* end */
+
+/**
+ * Appends an item to the current segment, and points pending labels at it
+ *
+ * @param assembler program
+ * @param opcode instruction, ASM_DATA, or ASM_END
+ * @param operand expression text (empty if none)
+ * @param line source line, for errors
+ * @return index of the new item
+ */
+int addItem(Assembler *assembler, int opcode, char const *operand, int line) {
+    if (assembler->itemCount == assembler->itemCapacity) {
+        assembler->itemCapacity = assembler->itemCapacity == 0 ? 256 : assembler->itemCapacity * 2;
+        assembler->items = realloc(assembler->items, assembler->itemCapacity * sizeof(AsmItem));
+        if (assembler->items == NULL)
+            errorExit("realloc() failed");
+    }
+
+    if (strlen(operand) >= ASM_NAME_LENGTH)
+        asmError(assembler, line, "operand too long");
+
+    int id = assembler->itemCount++;
+    AsmItem *item = &assembler->items[id];
+    item->opcode = opcode;
+    strcpy(item->operand, operand);
+    item->line = line;
+    item->address = 0;
+    item->labeled = false;
+
+    for (int i = 0; i < assembler->symbolCount; i++) {
+        if (assembler->symbols[i].item == ASM_PENDING) {
+            assembler->symbols[i].item = id;
+            item->labeled = true;
+        }
+    }
+
+    AsmSegment *segment = &assembler->segments[assembler->segmentCount - 1];
+    if (segment->count == segment->capacity) {
+        segment->capacity = segment->capacity == 0 ? 64 : segment->capacity * 2;
+        segment->items = realloc(segment->items, segment->capacity * sizeof(int));
+        if (segment->items == NULL)
+            errorExit("realloc() failed");
+    }
+    segment->items[segment->count++] = id;
+    return id;
+} /* end */
+
+/**
+ * Lays code out along unconditional jumps: the block at "jump label" is moved right after
+ * the jump and the jump is removed, unless another block falls into it.
+ * The first block (the segment's entry) stays put.
+ *
+ * @param assembler program
+ * @param segment relocatable segment
+ * @return number of jumps removed
+ */
+int chainBlocks(Assembler *assembler, AsmSegment *segment) {
+    int const count = segment->count;
+    int *blockOf = malloc(count * sizeof(int));
+    int *blockStart = malloc((count + 1) * sizeof(int));
+    int *order = malloc(count * sizeof(int));
+    bool *placed = calloc(count, sizeof(bool));
+    bool *removed = calloc(count, sizeof(bool));
+    if (blockOf == NULL || blockStart == NULL || order == NULL || placed == NULL || removed == NULL)
+        errorExit("malloc() failed");
+
+    // a block starts at a label or after an instruction that never falls through
+    int blockCount = 0;
+    for (int i = 0; i < count; i++) {
+        AsmItem const *item = &assembler->items[segment->items[i]];
+        if (i == 0 || item->labeled || item->opcode == ASM_END ||
+            isBlockEnd(assembler->items[segment->items[i - 1]].opcode))
+            blockStart[blockCount++] = i;
+        blockOf[i] = blockCount - 1;
+    }
+    blockStart[blockCount] = count;
+
+    // the last block is the end marker, it stays last
+    int orderCount = 0;
+    int jumps = 0;
+    for (int block = 0; block < blockCount - 1; block++) {
+        int current = block;
+        while (!placed[current]) {
+            placed[current] = true;
+            for (int i = blockStart[current]; i < blockStart[current + 1]; i++)
+                order[orderCount++] = i;
+
+            int lastIndex = blockStart[current + 1] - 1;
+            AsmItem const *last = &assembler->items[segment->items[lastIndex]];
+
+            // falls through: the next block has to follow
+            if (!isBlockEnd(last->opcode)) {
+                if (current + 1 < blockCount - 1)
+                    current += 1;
+                continue;
+            }
+
+            if (last->opcode != 20)
+                break;
+
+            AsmSymbol *symbol = findSymbol(assembler, last->operand);
+            if (symbol == NULL || symbol->item < 0)
+                break;
+
+            int target = -1;
+            for (int i = 1; i < count; i++) {
+                if (segment->items[i] == symbol->item)
+                    target = blockOf[i];
+            }
+
+            // target must start its block, not be the entry or end, and not be fallen into
+            if (target <= 0 || target == blockCount - 1 || placed[target] ||
+                segment->items[blockStart[target]] != symbol->item ||
+                !isBlockEnd(assembler->items[segment->items[blockStart[target] - 1]].opcode))
+                break;
+
+            removed[lastIndex] = true;
+            jumps += 1;
+            current = target;
+        }
+    }
+    for (int i = blockStart[blockCount - 1]; i < count; i++)
+        order[orderCount++] = i;
+
+    // reorder, then drop the jumps; their labels move to the block that now follows
+    int *items = malloc(count * sizeof(int));
+    if (items == NULL)
+        errorExit("malloc() failed");
+    for (int i = 0; i < count; i++)
+        items[i] = segment->items[order[i]];
+
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (!removed[order[i]]) {
+            segment->items[kept++] = items[i];
+            continue;
+        }
+        AsmItem *next = &assembler->items[items[i + 1]];
+        for (int s = 0; s < assembler->symbolCount; s++) {
+            if (assembler->symbols[s].item == items[i]) {
+                assembler->symbols[s].item = items[i + 1];
+                next->labeled = true;
+            }
+        }
+    }
+    segment->count = kept;
+
+    free(items);
+    free(removed);
+    free(placed);
+    free(order);
+    free(blockStart);
+    free(blockOf);
+    return jumps;
+} /* end */
+
+/**
+ * Evaluates an operand: a number, a character ('A'), or a symbol with an optional +/- offset
+ *
+ * @param assembler program
+ * @param operand expression text
+ * @param line source line, for errors
+ * @param constantsOnly true before layout, when labels have no address yet
+ * @return value
+ */
+Word evaluateOperand(Assembler *assembler, char const *operand, int line, bool constantsOnly) {
+    char const *c = operand;
+
+    if (c[0] == '\'') {
+        int value = (unsigned char)c[1];
+        if (c[1] == '\\') {
+            value = c[2] == 'n' ? '\n' : c[2] == 't' ? '\t' : c[2] == '0' ? 0 : (unsigned char)c[2];
+            c += 1;
+        }
+        if (c[1] == '\0' || c[2] != '\'' || c[3] != '\0')
+            asmError(assembler, line, "bad character constant");
+        return value;
+    }
+
+    char *end;
+    if (isdigit((unsigned char)c[0]) || c[0] == '-' || c[0] == '+') {
+        Word value = parseNumber(assembler, c, &end, line);
+        if (*end != '\0' || end == c)
+            asmError(assembler, line, "bad number");
+        return value;
+    }
+
+    if (!isalpha((unsigned char)c[0]) && c[0] != '_')
+        asmError(assembler, line, "bad operand");
+
+    char name[ASM_NAME_LENGTH];
+    int i = 0;
+    while (isalnum((unsigned char)c[i]) || c[i] == '_') {
+        name[i] = c[i];
+        i += 1;
+    }
+    name[i] = '\0';
+
+    Word offset = 0;
+    if (c[i] != '\0') {
+        offset = parseNumber(assembler, c + i + 1, &end, line);
+        if ((c[i] != '+' && c[i] != '-') || *end != '\0' || end == c + i + 1)
+            asmError(assembler, line, "bad operand");
+        if (c[i] == '-')
+            offset = WORD_SUB(0, offset);
+    }
+
+    AsmSymbol *symbol = findSymbol(assembler, name);
+    if (symbol == NULL)
+        asmError(assembler, line, "undefined symbol");
+
+    if (symbol->item == ASM_CONSTANT)
+        return WORD_ADD(symbol->value, offset);
+    if (constantsOnly)
+        asmError(assembler, line, "label used where a constant is needed");
+    return WORD_ADD(assembler->items[symbol->item].address, offset);
+} /* end */
+
+/**
+ * Looks up a mnemonic (case insensitive)
+ *
+ * @param mnemonic instruction name
+ * @return index into opcodes, -1 if unknown
+ */
+int findOpcode(char const *mnemonic) {
+    for (int i = 0; i < opcodeCount; i++) {
+        if (strcasecmp(opcodes[i].mnemonic, mnemonic) == 0)
+            return i;
+    }
+    return -1;
+} /* end */
+
+/**
+ * Returns the number of words an item takes
+ *
+ * @param item instruction, data word, or end marker
+ * @return words
+ */
+int itemSize(AsmItem const *item) {
+    if (item->opcode == ASM_END)
+        return 0;
+    if (item->opcode == ASM_DATA)
+        return 1;
+    return item->operand[0] != '\0' ? 2 : 1;
+} /* end */
+
+/**
+ * Removes redundant register copies and push/pop pairs, until none are left:
+ * CopyToX CopyFromX (and the reverse, for X, Y and SP) keeps the first,
+ * a repeated copy keeps one, and Push Pop is dropped.
+ * The second instruction of a pair must not be a jump target.
+ *
+ * @param assembler program
+ * @param segment relocatable segment
+ * @return number of instructions removed
+ */
+int removePeepholes(Assembler *assembler, AsmSegment *segment) {
+    int removedCount = 0;
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+        for (int i = 0; i + 1 < segment->count; i++) {
+            AsmItem *first = &assembler->items[segment->items[i]];
+            AsmItem *second = &assembler->items[segment->items[i + 1]];
+            if (first->opcode < 0 || second->opcode < 0 || second->labeled)
+                continue;
+
+            int a = first->opcode;
+            int b = second->opcode;
+            bool copyPair = a >= 14 && a <= 19 && b >= 14 && b <= 19 && (a - 14) / 2 == (b - 14) / 2;
+            int drop = 0;
+
+            if (copyPair)
+                drop = 1;
+            else if (a == 27 && b == 28)
+                drop = 2;
+            if (drop == 0)
+                continue;
+
+            // a dropped labeled Push hands its labels to the next item
+            int start = i + 2 - drop;
+            int next = segment->items[i + 2];
+            for (int s = 0; s < assembler->symbolCount && drop == 2; s++) {
+                if (assembler->symbols[s].item == segment->items[i]) {
+                    assembler->symbols[s].item = next;
+                    assembler->items[next].labeled = true;
+                }
+            }
+
+            memmove(segment->items + start, segment->items + i + 2, (segment->count - i - 2) * sizeof(int));
+            segment->count -= drop;
+            removedCount += drop;
+            changed = true;
+        }
+    }
+    return removedCount;
+} /* end */
+
+/**
+ * Reads a number that fits a word: negative down to WORD_MIN, or positive up to UWORD_MAX
+ * (which wraps to a negative word, so hex masks like 0xffffffff work)
+ *
+ * @param assembler program
+ * @param text number, in any base strtoll takes
+ * @param end set past the number
+ * @param line source line, for errors
+ * @return value
+ */
+Word parseNumber(Assembler *assembler, char const *text, char **end, int line) {
+    errno = 0;
+    if (text[0] == '-') {
+        long long value = strtoll(text, end, 0);
+        if (errno == ERANGE || value < WORD_MIN)
+            asmError(assembler, line, "number out of range");
+        return (Word)value;
+    }
+
+    unsigned long long value = strtoull(text, end, 0);
+    if (errno == ERANGE || value > UWORD_MAX)
+        asmError(assembler, line, "number out of range");
+    return (Word)value;
+} /* end */
+
+/**
+ * Reads the next token: a word ended by white space or a comma, or a quoted character
+ *
+ * @param assembler program
+ * @param cursor position in the line, advanced past the token
+ * @param token buffer, ASM_NAME_LENGTH bytes
+ * @param line source line, for errors
+ * @return token, NULL at end of line
+ */
+char *nextToken(Assembler *assembler, char **cursor, char *token, int line) {
+    char *c = *cursor;
+    while (isspace((unsigned char)*c) || *c == ',')
+        c += 1;
+    if (*c == '\0')
+        return NULL;
+
+    int i = 0;
+    bool quoted = false;
+    while (*c != '\0' && (quoted || (!isspace((unsigned char)*c) && *c != ','))) {
+        if (quoted && *c == '\\' && c[1] != '\0') {
+            if (i >= ASM_NAME_LENGTH - 2)
+                asmError(assembler, line, "token too long");
+            token[i++] = *c;
+            c += 1;
+        }
+        else if (*c == '\'') {
+            quoted = !quoted;
+        }
+        if (i >= ASM_NAME_LENGTH - 1)
+            asmError(assembler, line, "token too long");
+        token[i++] = *c;
+        c += 1;
+    }
+    token[i] = '\0';
+    *cursor = c;
+    return token;
+} /* end */
+
+/**
+ * Looks up a symbol
+ *
+ * @param assembler program
+ * @param name label or constant
+ * @return symbol, NULL if not defined
+ */
+AsmSymbol *findSymbol(Assembler *assembler, char const *name) {
+    for (int i = 0; i < assembler->symbolCount; i++) {
+        if (strcmp(assembler->symbols[i].name, name) == 0)
+            return &assembler->symbols[i];
+    }
+    return NULL;
+} /* end */
+
+/**
+ * Defines a label or constant
+ *
+ * @param assembler program
+ * @param name symbol name
+ * @param item labeled item, ASM_PENDING until the next item is added, or ASM_CONSTANT
+ * @param value constant value
+ * @param line source line, for errors
+ */
+void addSymbol(Assembler *assembler, char const *name, int item, Word value, int line) {
+    if (!isalpha((unsigned char)name[0]) && name[0] != '_')
+        asmError(assembler, line, "bad symbol name");
+    for (int i = 1; name[i] != '\0'; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+            asmError(assembler, line, "bad symbol name");
+    }
+    if (findSymbol(assembler, name) != NULL)
+        asmError(assembler, line, "symbol already defined");
+    if (findOpcode(name) != -1)
+        asmError(assembler, line, "symbol name is an instruction");
+
+    if (assembler->symbolCount == assembler->symbolCapacity) {
+        assembler->symbolCapacity = assembler->symbolCapacity == 0 ? 64 : assembler->symbolCapacity * 2;
+        assembler->symbols = realloc(assembler->symbols, assembler->symbolCapacity * sizeof(AsmSymbol));
+        if (assembler->symbols == NULL)
+            errorExit("realloc() failed");
+    }
+
+    AsmSymbol *symbol = &assembler->symbols[assembler->symbolCount++];
+    strcpy(symbol->name, name);
+    symbol->item = item;
+    symbol->value = value;
+    symbol->line = line;
+} /* end */
+
+/**
+ * Prints an error with its source line and exits
+ *
+ * @param assembler program
+ * @param line source line
+ * @param message what went wrong
+ */
+void asmError(Assembler *assembler, int line, char const *message) {
+    char text[256];
+    snprintf(text, sizeof(text), "%s:%d: %s", assembler->fileName, line, message);
+    errorExit(text);
+} /* end */
+
+/**
+ * Assembles every line of a source file
+ *
+ * @param assembler program
+ * @param file source
+ */
+void assembleFile(Assembler *assembler, FILE *file) {
+    char line[256];
+    int lineNumber = 0;
+
+    startSegment(assembler, 0);
+    while (fgets(line, sizeof(line), file)) {
+        lineNumber += 1;
+
+        // a line that didn't fit would come back as two, the rest under the wrong line number
+        if (strchr(line, '\n') == NULL && getc(file) != EOF)
+            asmError(assembler, lineNumber, "line too long");
+        assembleLine(assembler, line, lineNumber);
+    }
+
+    // closes the last segment
+    addItem(assembler, ASM_END, "", lineNumber);
+} /* end */
+
+/**
+ * Assembles one source line:
+ *
+ *     [label:] ... [mnemonic [operand]]     // comment
+ *     name = value
+ *     .address value
+ *     .word value, ...
+ *
+ * @param assembler program
+ * @param line source text, modified
+ * @param lineNumber for errors
+ */
+void assembleLine(Assembler *assembler, char *line, int lineNumber) {
+    char token[ASM_NAME_LENGTH];
+    char operand[ASM_NAME_LENGTH];
+
+    // comments start with //, ; or #, outside a quoted character
+    bool quoted = false;
+    for (char *c = line; *c != '\0'; c++) {
+        if (quoted && *c == '\\' && c[1] != '\0')
+            c += 1;
+        else if (*c == '\'')
+            quoted = !quoted;
+        else if (!quoted && (*c == ';' || *c == '#' || (c[0] == '/' && c[1] == '/'))) {
+            *c = '\0';
+            break;
+        }
+    }
+
+    char *cursor = line;
+    if (nextToken(assembler, &cursor, token, lineNumber) == NULL)
+        return;
+
+    // labels
+    size_t length = strlen(token);
+    while (length > 1 && token[length - 1] == ':') {
+        token[length - 1] = '\0';
+        addSymbol(assembler, token, ASM_PENDING, 0, lineNumber);
+        if (nextToken(assembler, &cursor, token, lineNumber) == NULL)
+            return;
+        length = strlen(token);
+    }
+
+    bool hasOperand = nextToken(assembler, &cursor, operand, lineNumber) != NULL;
+
+    if (strcmp(token, ".address") == 0) {
+        if (!hasOperand)
+            asmError(assembler, lineNumber, ".address needs a value");
+        Word address = evaluateOperand(assembler, operand, lineNumber, true);
+        if (address < 0 || address >= PARTITION_WORDS)
+            asmError(assembler, lineNumber, "segment address out of range");
+        startSegment(assembler, (int)address);
+    }
+    else if (strcmp(token, ".word") == 0) {
+        if (!hasOperand)
+            asmError(assembler, lineNumber, ".word needs a value");
+        do {
+            addItem(assembler, ASM_DATA, operand, lineNumber);
+        } while (nextToken(assembler, &cursor, operand, lineNumber) != NULL);
+    }
+    else if (hasOperand && strcmp(operand, "=") == 0) {
+        if (nextToken(assembler, &cursor, operand, lineNumber) == NULL)
+            asmError(assembler, lineNumber, "constant needs a value");
+        addSymbol(assembler, token, ASM_CONSTANT, evaluateOperand(assembler, operand, lineNumber, true), lineNumber);
+    }
+    else {
+        int index = findOpcode(token);
+        if (index == -1)
+            asmError(assembler, lineNumber, "unknown instruction");
+        if (opcodes[index].operand && !hasOperand)
+            asmError(assembler, lineNumber, "missing operand");
+        if (!opcodes[index].operand && hasOperand)
+            asmError(assembler, lineNumber, "instruction takes no operand");
+
+        addItem(assembler, opcodes[index].opcode, hasOperand ? operand : "", lineNumber);
+    }
+
+    if (nextToken(assembler, &cursor, token, lineNumber) != NULL)
+        asmError(assembler, lineNumber, "unexpected text after statement");
+} /* end */
+
+/**
+ * Prints an error message and exits
+ *
+ * @param s error message
+ */
+void errorExit(char *s) {
+    fprintf(stderr, "\nERROR: %s - exiting!\n\n", s);
+    exit(1);
+} /* end */
+
+/**
+ * Gives every item its address, checks segments fit in a partition without overlapping,
+ * and checks every operand evaluates
+ *
+ * @param assembler program
+ */
+void layoutProgram(Assembler *assembler) {
+    for (int s = 0; s < assembler->segmentCount; s++) {
+        AsmSegment *segment = &assembler->segments[s];
+        int address = segment->address;
+        for (int i = 0; i < segment->count; i++) {
+            AsmItem *item = &assembler->items[segment->items[i]];
+            item->address = address;
+            address += itemSize(item);
+        }
+        if (address > PARTITION_WORDS)
+            asmError(assembler, assembler->items[segment->items[0]].line, "segment ends past the partition");
+    }
+
+    // every operand has a value now, so errors show up before any output is written
+    for (int i = 0; i < assembler->itemCount; i++) {
+        AsmItem const *item = &assembler->items[i];
+        if (item->operand[0] != '\0')
+            evaluateOperand(assembler, item->operand, item->line, false);
+    }
+
+    for (int s = 0; s < assembler->segmentCount; s++) {
+        AsmSegment *segment = &assembler->segments[s];
+        int end = assembler->items[segment->items[segment->count - 1]].address;
+        for (int t = 0; t < assembler->segmentCount; t++) {
+            AsmSegment *other = &assembler->segments[t];
+            int otherEnd = assembler->items[other->items[other->count - 1]].address;
+            if (t != s && segment->address < end && other->address < otherEnd &&
+                segment->address <= other->address && other->address < end)
+                asmError(assembler, assembler->items[other->items[0]].line, "segment overlaps another");
+        }
+    }
+} /* end */
+
+/**
+ * Runs the peephole and layout passes on every segment that may move,
+ * and reports the words saved on stderr
+ *
+ * @param assembler program, already laid out
+ */
+void optimizeProgram(Assembler *assembler) {
+    int instructions = 0, jumps = 0;
+
+    for (int s = 0; s < assembler->segmentCount; s++) {
+        AsmSegment *segment = &assembler->segments[s];
+        if (!isRelocatable(assembler, segment)) {
+            fprintf(stderr, "%s: segment at %d has numeric addresses pointing into it, not optimized\n",
+                assembler->fileName, segment->address);
+            continue;
+        }
+        instructions += removePeepholes(assembler, segment);
+        jumps += chainBlocks(assembler, segment);
+        instructions += removePeepholes(assembler, segment);
+    }
+
+    layoutProgram(assembler);
+    fprintf(stderr, "%s: removed %d instructions and %d jumps (%d words)\n",
+        assembler->fileName, instructions, jumps, instructions + 2 * jumps);
+} /* end */
+
+/**
+ * Closes the current segment and starts a new one
+ *
+ * @param assembler program
+ * @param address first address of the new segment
+ */
+void startSegment(Assembler *assembler, int address) {
+    if (assembler->segmentCount > 0)
+        addItem(assembler, ASM_END, "", 0);
+
+    if (assembler->segmentCount == assembler->segmentCapacity) {
+        assembler->segmentCapacity = assembler->segmentCapacity == 0 ? 8 : assembler->segmentCapacity * 2;
+        assembler->segments = realloc(assembler->segments, assembler->segmentCapacity * sizeof(AsmSegment));
+        if (assembler->segments == NULL)
+            errorExit("realloc() failed");
+    }
+
+    AsmSegment *segment = &assembler->segments[assembler->segmentCount++];
+    memset(segment, 0, sizeof(*segment));
+    segment->address = address;
+} /* end */
+
+/**
+ * Writes a binary image: IMAGE_MAGIC (32 bits), then (address, count, words...) for each segment
+ *
+ * @param assembler program, laid out
+ * @param file output
+ */
+void writeImage(Assembler *assembler, FILE *file) {
+    uint32_t const magic = IMAGE_MAGIC;
+    Word words[PARTITION_WORDS];
+    fwrite(&magic, sizeof(magic), 1, file);
+
+    for (int s = 0; s < assembler->segmentCount; s++) {
+        AsmSegment *segment = &assembler->segments[s];
+        Word count = 0;
+        for (int i = 0; i < segment->count; i++) {
+            AsmItem const *item = &assembler->items[segment->items[i]];
+            if (item->opcode == ASM_END)
+                continue;
+            if (item->opcode == ASM_DATA) {
+                words[count++] = evaluateOperand(assembler, item->operand, item->line, false);
+                continue;
+            }
+            words[count++] = item->opcode;
+            if (item->operand[0] != '\0')
+                words[count++] = evaluateOperand(assembler, item->operand, item->line, false);
+        }
+        if (count == 0)
+            continue;
+
+        Word address = segment->address;
+        fwrite(&address, sizeof(Word), 1, file);
+        fwrite(&count, sizeof(Word), 1, file);
+        if (fwrite(words, sizeof(Word), count, file) != (size_t)count)
+            errorExit("image write failed");
+    }
+} /* end */
+
+/**
+ * Writes the text format processFileInput() reads: one word per line,
+ * .address lines to move the loader, and the source instruction as a comment
+ *
+ * @param assembler program, laid out
+ * @param file output
+ */
+void writeText(Assembler *assembler, FILE *file) {
+    int loadAddress = 0;
+
+    for (int s = 0; s < assembler->segmentCount; s++) {
+        AsmSegment *segment = &assembler->segments[s];
+        for (int i = 0; i < segment->count; i++) {
+            AsmItem const *item = &assembler->items[segment->items[i]];
+            if (item->opcode == ASM_END)
+                continue;
+
+            if (item->address != loadAddress)
+                fprintf(file, ".%d\n", item->address);
+            loadAddress = item->address + itemSize(item);
+
+            if (item->opcode == ASM_DATA) {
+                fprintf(file, WORD_FORMAT "\n", evaluateOperand(assembler, item->operand, item->line, false));
+                continue;
+            }
+
+            int index = 0;
+            while (opcodes[index].opcode != item->opcode)
+                index += 1;
+            if (item->operand[0] == '\0') {
+                fprintf(file, "%-4d // %s\n", item->opcode, opcodes[index].mnemonic);
+                continue;
+            }
+            fprintf(file, "%-4d // %s %s\n", item->opcode, opcodes[index].mnemonic, item->operand);
+            fprintf(file, WORD_FORMAT "\n", evaluateOperand(assembler, item->operand, item->line, false));
+        }
+    }
+} /* end */
@@ -0,0 +1,86 @@
+#ifndef CPU_MEM_ASM_H_
+#define CPU_MEM_ASM_H_
+
+#define ASM_NAME_LENGTH 64
+
+// item kinds that are not instructions
+#define ASM_DATA -1
+#define ASM_END -2
+
+// symbol items that are not items
+#define ASM_CONSTANT -1
+#define ASM_PENDING -2
+
+// one instruction or data word; labels point at items, so code can move while optimizing
+typedef struct AsmItem {
+    int opcode;
+    char operand[ASM_NAME_LENGTH];
+    int line;
+    int address;
+    bool labeled;
+} AsmItem;
+
+// a label (item >= 0) or a constant (item == ASM_CONSTANT)
+typedef struct AsmSymbol {
+    char name[ASM_NAME_LENGTH];
+    int item;
+    Word value;
+    int line;
+} AsmSymbol;
+
+// items placed from address on, in order
+typedef struct AsmSegment {
+    int address;
+    int *items;
+    int count;
+    int capacity;
+} AsmSegment;
+
+typedef struct Assembler {
+    char const *fileName;
+    AsmItem *items;
+    int itemCount;
+    int itemCapacity;
+    AsmSymbol *symbols;
+    int symbolCount;
+    int symbolCapacity;
+    AsmSegment *segments;
+    int segmentCount;
+    int segmentCapacity;
+} Assembler;
+
+typedef struct AsmOpcode {
+    char const *mnemonic;
+    int opcode;
+    bool operand;
+} AsmOpcode;
+
+bool hasAddressOperand(int opcode);
+bool isBlockEnd(int opcode);
+bool isRelocatable(Assembler *assembler, AsmSegment *segment);
+
+int addItem(Assembler *assembler, int opcode, char const *operand, int line);
+int chainBlocks(Assembler *assembler, AsmSegment *segment);
+int findOpcode(char const *mnemonic);
+int itemSize(AsmItem const *item);
+int removePeepholes(Assembler *assembler, AsmSegment *segment);
+
+Word evaluateOperand(Assembler *assembler, char const *operand, int line, bool constantsOnly);
+Word parseNumber(Assembler *assembler, char const *text, char **end, int line);
+
+char *nextToken(Assembler *assembler, char **cursor, char *token, int line);
+
+AsmSymbol *findSymbol(Assembler *assembler, char const *name);
+
+void addSymbol(Assembler *assembler, char const *name, int item, Word value, int line);
+void asmError(Assembler *assembler, int line, char const *message);
+void assembleFile(Assembler *assembler, FILE *file);
+void assembleLine(Assembler *assembler, char *line, int lineNumber);
+void errorExit(char *s);
+void layoutProgram(Assembler *assembler);
+void optimizeProgram(Assembler *assembler);
+void startSegment(Assembler *assembler, int address);
+void writeImage(Assembler *assembler, FILE *file);
+void writeText(Assembler *assembler, FILE *file);
+
+#endif
@@ -0,0 +1,409 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu_mem_sim.h"
+#include "cpu_mem_fuzz.h"
+
+// libFuzzer reads guest edges from this section as extra counters, next to its own host coverage
+#ifdef LIBFUZZER
+__attribute__((used, section("__libfuzzer_extra_counters")))
+#endif
+static unsigned char edges[COVERAGE_EDGES];
+
+static FuzzHarness harness;
+
+#ifndef LIBFUZZER
+/**
+ * main
+ *
+ * Runs the CPU on fuzz inputs in this process, with memory in an image instead of a child process.
+ * Without -r, each input is run once and its status is printed (program output goes to stdout).
+ * With -r, the inputs seed a corpus that is mutated for that many runs, keeping inputs that
+ * find new guest edges (and writing them to -o directory).
+ *
+ * Usage: cpu_mem_fuzz [-k systemFile] [-i interrupt] [-l steps] [-r runs [-S seed] [-o directory]] input ...
+ *
+ * Build: gcc -O2 -DFUZZING -o cpu_mem_fuzz src/C/cpu_mem_fuzz.c src/C/cpu_mem_sim.c
+ *        clang -O2 -g -fsanitize=fuzzer,address -DFUZZING -DLIBFUZZER -o cpu_mem_fuzz src/C/cpu_mem_fuzz.c src/C/cpu_mem_sim.c
+ *
+ * @param argc holds count for command line arguments
+ * @param argv holds values from command line entries
+ */
+int main(int argc, char **argv) {
+    int option;
+    char const *baseFile = NULL;
+    char const *directory = NULL;
+    int interrupt = 100;
+    long stepLimit = 10000;
+    long runs = 0;
+    unsigned int seed = (unsigned int)time(NULL) | 1u;
+
+    while ((option = getopt(argc, argv, "k:i:l:r:S:o:")) != -1) {
+        switch (option) {
+            case 'k':
+                baseFile = optarg;
+                break;
+            case 'i':
+                interrupt = atoi(optarg);
+                break;
+            case 'l':
+                stepLimit = atol(optarg);
+                break;
+            case 'r':
+                runs = atol(optarg);
+                break;
+            case 'S':
+                seed = strtoul(optarg, NULL, 0) | 1u;
+                break;
+            case 'o':
+                directory = optarg;
+                break;
+            default:
+                errorExit("unknown option");
+        }
+    }
+
+    if (interrupt <= 0 || stepLimit <= 0)
+        errorExit("interrupt and step limit must be positive numbers");
+
+    if (runs == 0 && optind == argc)
+        errorExit("wrong number of arguments");
+
+    initFuzzHarness(&harness, baseFile, interrupt, stepLimit);
+
+    if (runs == 0) {
+        for (int i = optind; i < argc; i++) {
+            FuzzInput input;
+            readInputFile(argv[i], &input);
+
+            RunStatus status = runFuzzInput(&harness, input.data, input.size);
+            fflush(stdout);
+
+            fprintf(stderr, "\n%s: %s, %ld instructions, %d edges\n",
+                    argv[i], runStatusMessage(status), harness.metrics.instructions, harness.coverage.touchedCount);
+            free(input.data);
+        }
+        return 0;
+    }
+
+    FuzzCorpus *corpus = calloc(1, sizeof(FuzzCorpus));
+    if (corpus == NULL)
+        errorExit("calloc() failed");
+
+    for (int i = optind; i < argc; i++) {
+        FuzzInput input;
+        readInputFile(argv[i], &input);
+        addCorpusInput(corpus, input.data, input.size, NULL);
+        free(input.data);
+    }
+
+    // an empty corpus starts from an empty program; mutations grow it
+    if (corpus->count == 0)
+        addCorpusInput(corpus, NULL, 0, NULL);
+
+    // guest output would cost more than the runs themselves
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        errorExit("freopen() failed");
+
+    fuzzLoop(&harness, corpus, runs, seed, directory);
+
+    for (int i = 0; i < corpus->count; i++)
+        free(corpus->inputs[i].data);
+    free(corpus->inputs);
+    free(corpus);
+    return 0;
+} /* end main */
+#endif
+
+/**
+ * Records which edges reached a hit count bucket (1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+)
+ * they hadn't reached before; a loop running more often counts as new behavior, as in AFL
+ *
+ * @param corpus holds the buckets seen so far
+ * @param coverage hit counters and touched edges from one run
+ * @return true if any edge reached a new bucket
+ */
+bool hasNewCoverage(FuzzCorpus *corpus, Coverage const *coverage) {
+    bool found = false;
+
+    for (int i = 0; i < coverage->touchedCount; i++) {
+        int edge = coverage->touched[i];
+        unsigned int count = coverage->edges[edge];
+
+        unsigned char bucket = count <= 2 ? count : count == 3 ? 4 : count < 8 ? 8 :
+                               count < 16 ? 16 : count < 32 ? 32 : count < 128 ? 64 : 128;
+        if ((corpus->seen[edge] & bucket) == 0) {
+            if (corpus->seen[edge] == 0)
+                corpus->edgeCount += 1;
+            corpus->seen[edge] |= bucket;
+            found = true;
+        }
+    }
+    return found;
+} /* end */
+
+/**
+ * libFuzzer setup, once per process
+ * Reads CPU_MEM_FUZZ_SYSTEM (system code file), CPU_MEM_FUZZ_INTERRUPT and CPU_MEM_FUZZ_STEPS
+ *
+ * @param argc unused
+ * @param argv unused
+ * @return 0
+ */
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    (void)argc;
+    (void)argv;
+
+    char const *interrupt = getenv("CPU_MEM_FUZZ_INTERRUPT");
+    char const *steps = getenv("CPU_MEM_FUZZ_STEPS");
+    initFuzzHarness(&harness, getenv("CPU_MEM_FUZZ_SYSTEM"),
+                    interrupt != NULL ? atoi(interrupt) : 100, steps != NULL ? atol(steps) : 10000);
+
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        errorExit("freopen() failed");
+    return 0;
+} /* end */
+
+/**
+ * libFuzzer entry point: runs one input; guest errors are statuses, so only host bugs crash
+ *
+ * @param data input bytes
+ * @param size input length
+ * @return 0
+ */
+int LLVMFuzzerTestOneInput(uint8_t const *data, size_t size) {
+    runFuzzInput(&harness, data, size);
+    return 0;
+} /* end */
+
+/**
+ * Changes one word of an input: an opcode, an address or small value, a flipped bit,
+ * an inserted, removed, or duplicated word
+ *
+ * @param data input, room for FUZZ_MAX_WORDS words
+ * @param size input length in bytes, a multiple of FUZZ_WORD_BYTES
+ * @param seed random state
+ * @return new length in bytes
+ */
+size_t mutateInput(uint8_t *data, size_t size, unsigned int *seed) {
+    int words = size / FUZZ_WORD_BYTES;
+    int choice = nextRandom(seed) % 6;
+    int ptr = words > 0 ? nextRandom(seed) % words : 0;
+    int16_t value = 0;
+
+    if (words == 0 || (choice == 3 && words < FUZZ_MAX_WORDS)) {
+        // insert a word (opcode or operand) before ptr
+        memmove(data + (ptr + 1) * FUZZ_WORD_BYTES, data + ptr * FUZZ_WORD_BYTES, (words - ptr) * FUZZ_WORD_BYTES);
+        words += 1;
+        choice = nextRandom(seed) % 2;
+    }
+    else if (choice == 4) {
+        memmove(data + ptr * FUZZ_WORD_BYTES, data + (ptr + 1) * FUZZ_WORD_BYTES, (words - ptr - 1) * FUZZ_WORD_BYTES);
+        return (words - 1) * FUZZ_WORD_BYTES;
+    }
+
+    switch (choice) {
+        case 0:
+            value = nextRandom(seed) % 51;
+            break;
+        case 1:
+            value = (int16_t)(nextRandom(seed) % (PARTITION_WORDS + 8)) - 4;
+            break;
+        case 2:
+            memcpy(&value, data + ptr * FUZZ_WORD_BYTES, sizeof(value));
+            value ^= 1 << (nextRandom(seed) % 16);
+            break;
+        default:
+            memcpy(&value, data + (nextRandom(seed) % words) * FUZZ_WORD_BYTES, sizeof(value));
+            break;
+    }
+
+    data[ptr * FUZZ_WORD_BYTES] = (uint16_t)value & 0xff;
+    data[ptr * FUZZ_WORD_BYTES + 1] = (uint16_t)value >> 8;
+    return words * FUZZ_WORD_BYTES;
+} /* end */
+
+/**
+ * Runs one input: the base image with the input's words from address 0, a fresh process,
+ * and a fresh interrupt controller, all in this process
+ *
+ * @param harness base image, image, limits, and coverage (what this run used is left there)
+ * @param data input bytes, FUZZ_WORD_BYTES per word (a trailing odd byte is ignored)
+ * @param size input length
+ * @return how the run ended
+ */
+RunStatus runFuzzInput(FuzzHarness *harness, uint8_t const *data, size_t size) {
+    size_t words = size / FUZZ_WORD_BYTES;
+    if (words > FUZZ_MAX_WORDS)
+        words = FUZZ_MAX_WORDS;
+
+    memcpy(harness->image, harness->base, sizeof(harness->image));
+    for (size_t i = 0; i < words; i++)
+        harness->image[i] = (int16_t)(data[i * FUZZ_WORD_BYTES] | data[i * FUZZ_WORD_BYTES + 1] << 8);
+
+    ProcessControlBlock process;
+    memset(&process, 0, sizeof(process));
+    process.fileName = "fuzz input";
+
+    Scheduler scheduler;
+    initScheduler(&scheduler, ROUND_ROBIN, &process, 1);
+
+    int const priority[IRQ_SOURCES] = { 0, 1, 2, 3 };
+    InterruptController controller;
+    initInterruptController(&controller, priority, 0, 0);
+
+    // only the edges the last run touched are cleared
+    Coverage *coverage = &harness->coverage;
+    for (int i = 0; i < coverage->touchedCount; i++)
+        coverage->edges[coverage->touched[i]] = 0;
+    coverage->touchedCount = 0;
+    coverage->previous = 0;
+
+    // random numbers follow from the input (FNV-1a over its bytes), never from the clock
+    unsigned int seed = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+        seed = (seed ^ data[i]) * 16777619u;
+    coverage->randomSeed = seed | 1u;
+
+    MemoryBus bus = { NULL, NULL, NULL, harness->image, harness->image, 0, 0, 0, 
+                      { { 0 } }, 0, NULL, NULL, NULL, &coverage->randomSeed };
+    return cpuProcess(&bus, harness->interrupt, &scheduler, &controller, &harness->limits, &harness->metrics, 
+                      NULL, coverage);
+} /* end */
+
+/**
+ * Adds a copy of an input to the corpus, and writes it to directory
+ *
+ * @param corpus inputs kept so far
+ * @param data input bytes
+ * @param size input length
+ * @param directory where new inputs are written (NULL to keep them in memory only)
+ */
+void addCorpusInput(FuzzCorpus *corpus, uint8_t const *data, size_t size, char const *directory) {
+    if (corpus->count == corpus->capacity) {
+        corpus->capacity = corpus->capacity == 0 ? 64 : corpus->capacity * 2;
+        corpus->inputs = realloc(corpus->inputs, corpus->capacity * sizeof(FuzzInput));
+        if (corpus->inputs == NULL)
+            errorExit("realloc() failed");
+    }
+
+    FuzzInput *input = &corpus->inputs[corpus->count];
+    input->data = malloc(FUZZ_MAX_WORDS * FUZZ_WORD_BYTES);
+    if (input->data == NULL)
+        errorExit("malloc() failed");
+    if (size > 0)
+        memcpy(input->data, data, size);
+    input->size = size;
+
+    if (directory != NULL) {
+        char fileName[4096];
+        snprintf(fileName, sizeof(fileName), "%s/input-%06d", directory, corpus->count);
+        FILE *fp = fopen(fileName, "wb");
+        if (fp == NULL || fwrite(data, 1, size, fp) != size)
+            errorExit("corpus file failed to write");
+        fclose(fp);
+    }
+    corpus->count += 1;
+} /* end */
+
+/**
+ * Mutates corpus inputs for a number of runs, keeping the ones that reach new edges,
+ * then prints runs per second, corpus size, edges, and how runs ended to stderr
+ *
+ * @param harness base image, image, and limits
+ * @param corpus seed inputs, grows as coverage is found
+ * @param runs number of runs
+ * @param seed random state
+ * @param directory where new inputs are written (NULL to keep them in memory only)
+ */
+void fuzzLoop(FuzzHarness *harness, FuzzCorpus *corpus, long runs, unsigned int seed, char const *directory) {
+    uint8_t data[FUZZ_MAX_WORDS * FUZZ_WORD_BYTES];
+    long statusCount[FUZZ_STATUSES] = { 0 };
+    long instructions = 0;
+    struct timespec started, finished;
+
+    // seed inputs count towards coverage, so mutants must beat them
+    for (int i = 0; i < corpus->count; i++) {
+        runFuzzInput(harness, corpus->inputs[i].data, corpus->inputs[i].size);
+        hasNewCoverage(corpus, &harness->coverage);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (long run = 0; run < runs; run++) {
+        FuzzInput *parent = &corpus->inputs[nextRandom(&seed) % corpus->count];
+        memcpy(data, parent->data, parent->size);
+
+        // a few stacked mutations per run
+        size_t size = parent->size;
+        int mutations = 1 + nextRandom(&seed) % 4;
+        for (int i = 0; i < mutations; i++)
+            size = mutateInput(data, size, &seed);
+
+        RunStatus status = runFuzzInput(harness, data, size);
+        statusCount[status] += 1;
+        instructions += harness->metrics.instructions;
+
+        if (hasNewCoverage(corpus, &harness->coverage))
+            addCorpusInput(corpus, data, size, directory);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    double seconds = elapsedNanoseconds(&started, &finished) / 1e9;
+    fprintf(stderr, "%ld runs in %.3f s (%.0f runs/s, %.1f guest MIPS), corpus %d, edges %d\n",
+            runs, seconds, runs / seconds, instructions / seconds / 1e6, corpus->count, corpus->edgeCount);
+    for (int status = 0; status < FUZZ_STATUSES; status++) {
+        if (statusCount[status] > 0)
+            fprintf(stderr, "%12ld  %s\n", statusCount[status], runStatusMessage(status));
+    }
+} /* end */
+
+/**
+ * Sets up the base image (system code from a program file, or timer and system call
+ * handlers that only return) and the limits every run uses
+ *
+ * @param harness to initialize
+ * @param baseFile program file for the base image, NULL for the default handlers
+ * @param interrupt timer interval in instructions
+ * @param stepLimit instructions before a run stops
+ */
+void initFuzzHarness(FuzzHarness *harness, char const *baseFile, int interrupt, long stepLimit) {
+    memset(harness, 0, sizeof(*harness));
+    harness->coverage.edges = edges;
+    harness->coverage.touched = harness->touched;
+    harness->limits.instructions = stepLimit > 0 ? stepLimit : 10000;
+    harness->interrupt = interrupt > 0 ? interrupt : 100;
+
+    if (baseFile != NULL) {
+        validateFile(harness->base, baseFile);
+    }
+    else {
+        // 30 = return from interrupt, at the timer (1000) and system call (1500) vectors
+        harness->base[1000] = 30;
+        harness->base[1500] = 30;
+    }
+} /* end */
+
+/**
+ * Reads a whole input file
+ *
+ * @param fileName input to read, at most FUZZ_MAX_WORDS words are kept
+ * @param input data (FUZZ_MAX_WORDS words of room, caller frees) and size are set
+ */
+void readInputFile(char const *fileName, FuzzInput *input) {
+    FILE *fp = fopen(fileName, "rb");
+    if (fp == NULL)
+        errorExit("File failed to open");
+
+    input->data = malloc(FUZZ_MAX_WORDS * FUZZ_WORD_BYTES);
+    if (input->data == NULL)
+        errorExit("malloc() failed");
+
+    input->size = fread(input->data, 1, FUZZ_MAX_WORDS * FUZZ_WORD_BYTES, fp);
+    input->size -= input->size % FUZZ_WORD_BYTES;
+    fclose(fp);
+} /* end */
@@ -0,0 +1,49 @@
+#ifndef CPU_MEM_FUZZ_H_
+#define CPU_MEM_FUZZ_H_
+
+// fuzz inputs are 16-bit little endian words (sign extended), loaded from address 0
+#define FUZZ_WORD_BYTES 2
+#define FUZZ_MAX_WORDS 1000
+
+#define FUZZ_STATUSES (RUN_VECTOR_FAULT + 1)
+
+// everything a run needs, set up once; each run copies base over image and clears the edges it touched
+typedef struct FuzzHarness {
+    Word base[PARTITION_WORDS];
+    Word image[PARTITION_WORDS];
+    int touched[COVERAGE_EDGES];
+    Coverage coverage;
+    RunLimits limits;
+    Metrics metrics;
+    int interrupt;
+} FuzzHarness;
+
+typedef struct FuzzInput {
+    uint8_t *data;
+    size_t size;
+} FuzzInput;
+
+// inputs that found new coverage; seen holds the hit count buckets found so far per edge
+typedef struct FuzzCorpus {
+    FuzzInput *inputs;
+    int count;
+    int capacity;
+    unsigned char seen[COVERAGE_EDGES];
+    int edgeCount;
+} FuzzCorpus;
+
+bool hasNewCoverage(FuzzCorpus *corpus, Coverage const *coverage);
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(uint8_t const *data, size_t size);
+
+size_t mutateInput(uint8_t *data, size_t size, unsigned int *seed);
+
+RunStatus runFuzzInput(FuzzHarness *harness, uint8_t const *data, size_t size);
+
+void addCorpusInput(FuzzCorpus *corpus, uint8_t const *data, size_t size, char const *directory);
+void fuzzLoop(FuzzHarness *harness, FuzzCorpus *corpus, long runs, unsigned int seed, char const *directory);
+void initFuzzHarness(FuzzHarness *harness, char const *baseFile, int interrupt, long stepLimit);
+void readInputFile(char const *fileName, FuzzInput *input);
+
+#endif
@@ -0,0 +1,188 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cpu_mem_sim.h"
+#include "cpu_mem_instance.h"
+#include "cpu_mem_aot.h"
+
+static _Thread_local SimulatorArena arena;
+
+/**
+ * Releases this thread's arena, once every instance created on it is destroyed
+ *
+ * @return true, or false (and nothing is released) while instances are in use
+ */
+bool freeSimulatorArena() {
+    if (arena.live != 0)
+        return false;
+
+    while (arena.chunks != NULL) {
+        SimulatorChunk *next = arena.chunks->next;
+        free(arena.chunks);
+        arena.chunks = next;
+    }
+    arena.freeList = NULL;
+    return true;
+} /* end */
+
+/**
+ * Runs a simulator until its program ends, or for a number of instructions
+ * A run that stops early picks up where it stopped the next time; one that ended stays ended
+ * (and runs nothing) until a reset. With a translation attached, its native code runs what it can
+ *
+ * @param simulator instance to run
+ * @param instructions most instructions to run, 0 for no limit
+ * @return how the run ended (RUN_INSTRUCTION_LIMIT when instructions ran out)
+ */
+RunStatus runSimulator(Simulator *simulator, long instructions) {
+    if (simulator->translation != NULL)
+        return runTranslation(simulator, instructions);
+
+    if (simulator->scheduler.liveCount == 0) {
+        memset(&simulator->metrics, 0, sizeof(simulator->metrics));
+        return RUN_FINISHED;
+    }
+
+    // the process left the ready queue when the last run picked it
+    if (simulator->scheduler.readyLevels == 0)
+        enqueueProcess(&simulator->scheduler, 0);
+
+    simulator->limits.instructions = instructions;
+    return cpuProcess(&simulator->bus, simulator->interrupt, &simulator->scheduler, &simulator->controller,
+                      instructions > 0 ? &simulator->limits : NULL, &simulator->metrics, NULL, NULL);
+} /* end */
+
+/**
+ * Takes an instance from this thread's arena (a destroyed one if there is one) and loads an image
+ *
+ * @param image PARTITION_WORDS words, user program and system code
+ * @param interrupt timer interval in instructions (10000 if not positive)
+ * @return instance, reset and ready to run, NULL if the arena can't grow
+ */
+Simulator *createSimulator(Word const *image, int interrupt) {
+    Simulator *simulator = arena.freeList;
+    if (simulator != NULL) {
+        arena.freeList = simulator->nextFree;
+    }
+    else {
+        if (arena.chunks == NULL || arena.chunks->used == SIMULATOR_CHUNK) {
+            SimulatorChunk *chunk = malloc(sizeof(SimulatorChunk));
+            if (chunk == NULL)
+                return NULL;
+            chunk->next = arena.chunks;
+            chunk->used = 0;
+            arena.chunks = chunk;
+        }
+        simulator = &arena.chunks->simulators[arena.chunks->used];
+        arena.chunks->used += 1;
+    }
+    arena.live += 1;
+
+    simulator->interrupt = interrupt > 0 ? interrupt : 10000;
+    simulator->outputFunction = NULL;
+    simulator->outputContext = NULL;
+    simulator->translation = NULL;
+    simulator->nextFree = NULL;
+    memset(&simulator->limits, 0, sizeof(simulator->limits));
+
+    // each instance has its own random numbers, seeded apart from instances created the same second
+    simulator->randomSeed = ((unsigned int)time(NULL) ^ (unsigned int)(uintptr_t)simulator) | 1u;
+
+    MemoryBus bus = { NULL, NULL, NULL, simulator->image, simulator->image, 0, 0, 0,
+                      { { 0 } }, 0, simulator->dirtyPages, appendSimulatorOutput, simulator,
+                      &simulator->randomSeed };
+    simulator->bus = bus;
+
+    loadSimulator(simulator, image);
+    return simulator;
+} /* end */
+
+/**
+ * Adds AC to a simulator's output, as showAC would print it, or hands it to the output function
+ *
+ * @param context the simulator
+ * @param port 1 for an int, 2 for a char
+ * @param AC value to output
+ */
+void appendSimulatorOutput(void *context, Word port, Word AC) {
+    Simulator *simulator = context;
+    if (simulator->outputFunction != NULL) {
+        if (port == 1 || port == 2)
+            simulator->outputFunction(simulator->outputContext, port, AC);
+        return;
+    }
+
+    int room = SIMULATOR_OUTPUT_BYTES - simulator->outputLength;
+    char *end = simulator->output + simulator->outputLength;
+
+    // one byte is kept for the terminating null
+    if (port == 1) {
+        int length = snprintf(end, room, WORD_FORMAT, AC);
+        simulator->outputLength += length < room ? length : room - 1;
+    }
+    if (port == 2 && room > 1) {
+        end[0] = AC;
+        end[1] = '\0';
+        simulator->outputLength += 1;
+    }
+} /* end */
+
+/**
+ * Puts an instance back on this thread's free list; its memory is kept for the next create
+ *
+ * @param simulator instance created on this thread
+ */
+void destroySimulator(Simulator *simulator) {
+    simulator->nextFree = arena.freeList;
+    arena.freeList = simulator;
+    arena.live -= 1;
+} /* end */
+
+/**
+ * Replaces the image an instance was created with, and resets it; a translation is detached
+ *
+ * @param simulator instance to load
+ * @param image PARTITION_WORDS words, user program and system code
+ */
+void loadSimulator(Simulator *simulator, Word const *image) {
+    memcpy(simulator->base, image, sizeof(simulator->base));
+    memcpy(simulator->image, image, sizeof(simulator->image));
+    memset(simulator->dirtyPages, 0, sizeof(simulator->dirtyPages));
+    simulator->translation = NULL;
+    resetSimulator(simulator);
+} /* end */
+
+/**
+ * Puts an instance back to the state createSimulator left it in
+ * Memory costs a copy of each page written since the last reset; the rest is fixed size
+ *
+ * @param simulator instance to reset
+ */
+void resetSimulator(Simulator *simulator) {
+    for (int i = 0; i < SIMULATOR_DIRTY_WORDS; i++) {
+        unsigned int bits = simulator->dirtyPages[i];
+        while (bits != 0) {
+            int first = (i * 32 + __builtin_ctz(bits)) * PAGE_WORDS;
+            int count = (first + PAGE_WORDS <= PARTITION_WORDS) ? PAGE_WORDS : PARTITION_WORDS - first;
+            memcpy(simulator->image + first, simulator->base + first, count * sizeof(Word));
+            bits &= bits - 1;
+        }
+        simulator->dirtyPages[i] = 0;
+    }
+
+    memset(&simulator->process, 0, sizeof(simulator->process));
+    simulator->process.fileName = "simulator";
+    initScheduler(&simulator->scheduler, ROUND_ROBIN, &simulator->process, 1);
+
+    int const priority[IRQ_SOURCES] = { 0, 1, 2, 3 };
+    initInterruptController(&simulator->controller, priority, 0, 0);
+
+    memset(&simulator->metrics, 0, sizeof(simulator->metrics));
+    simulator->translationStale = false;
+    simulator->output[0] = '\0';
+    simulator->outputLength = 0;
+} /* end */
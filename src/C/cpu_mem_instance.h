@@ -0,0 +1,66 @@
+#ifndef CPU_MEM_INSTANCE_H_
+#define CPU_MEM_INSTANCE_H_
+
+// dirty bits for one partition, 32 pages to an unsigned int
+#define SIMULATOR_PAGES ((PARTITION_WORDS + PAGE_WORDS - 1) / PAGE_WORDS)
+#define SIMULATOR_DIRTY_WORDS ((SIMULATOR_PAGES + 31) / 32)
+
+// guest output kept from one reset to the next; output past this is dropped
+#define SIMULATOR_OUTPUT_BYTES 4096
+
+// takes guest output instead of the buffer (port 1 is an int, port 2 a char)
+typedef void (*SimulatorOutput)(void *context, int port, int64_t value);
+
+// instances carved from one arena allocation
+#define SIMULATOR_CHUNK 8
+
+// one program run in this process: the loaded image, the image runs change, and everything else
+// a run needs, allocated once; a reset copies back only the pages written since the last one
+// (a translation of the loaded image, cpu_mem_aot.c, goes stale once a run changes its code)
+typedef struct Simulator {
+    Word base[PARTITION_WORDS];
+    Word image[PARTITION_WORDS];
+    unsigned int dirtyPages[SIMULATOR_DIRTY_WORDS];
+    ProcessControlBlock process;
+    Scheduler scheduler;
+    InterruptController controller;
+    MemoryBus bus;
+    RunLimits limits;
+    Metrics metrics;
+    int interrupt;
+    unsigned int randomSeed;
+    char output[SIMULATOR_OUTPUT_BYTES];
+    int outputLength;
+    SimulatorOutput outputFunction;
+    void *outputContext;
+    struct Translation const *translation;
+    bool translationStale;
+    struct Simulator *nextFree;
+} Simulator;
+
+typedef struct SimulatorChunk {
+    struct SimulatorChunk *next;
+    int used;
+    Simulator simulators[SIMULATOR_CHUNK];
+} SimulatorChunk;
+
+// each thread has its own arena, so creating an instance takes no lock; destroyed instances go on
+// the free list, so creating and destroying them in the steady state never touches the heap
+typedef struct SimulatorArena {
+    SimulatorChunk *chunks;
+    Simulator *freeList;
+    int live;
+} SimulatorArena;
+
+bool freeSimulatorArena();
+
+RunStatus runSimulator(Simulator *simulator, long instructions);
+
+Simulator *createSimulator(Word const *image, int interrupt);
+
+void appendSimulatorOutput(void *context, Word port, Word AC);
+void destroySimulator(Simulator *simulator);
+void loadSimulator(Simulator *simulator, Word const *image);
+void resetSimulator(Simulator *simulator);
+
+#endif
@@ -0,0 +1,295 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cpu_mem_sim.h"
+#include "cpu_mem_instance.h"
+#include "cpu_mem_aot.h"
+#include "cpu_mem_lib.h"
+
+/*
+ * libcpumem
+ *
+ * A handle is a simulator instance (cpu_mem_instance.c) under another name, so it comes from the
+ * calling thread's arena and has to be destroyed on that thread. Guest errors already end a run
+ * with a status; loading reports a bad program with a status too, so nothing here calls errorExit.
+ *
+ * Build: gcc -O2 -fPIC -shared -fvisibility=hidden -DCPU_MEM_LIBRARY -o libcpumem.so
+ *            src/C/cpu_mem_lib.c src/C/cpu_mem_instance.c src/C/cpu_mem_aot.c src/C/cpu_mem_sim.c -ldl
+ */
+
+_Static_assert(CPU_MEM_WORDS == PARTITION_WORDS, "CPU_MEM_WORDS must match PARTITION_WORDS");
+_Static_assert(CPU_MEM_VECTOR_FAULT == RUN_VECTOR_FAULT, "run statuses must match RunStatus");
+
+static Word const emptyImage[PARTITION_WORDS];
+
+/**
+ * Describes a status from any call
+ *
+ * @param status run status, or a negative error
+ * @return message (static)
+ */
+char const *cpuMemStatusMessage(int status) {
+    if (status >= CPU_MEM_FINISHED && status <= CPU_MEM_VECTOR_FAULT)
+        return runStatusMessage(status);
+
+    switch (status) {
+        case CPU_MEM_BAD_ARGUMENT:
+            return "bad argument";
+        case CPU_MEM_BAD_IMAGE:
+            return "program does not load";
+        case CPU_MEM_NO_MEMORY:
+            return "out of memory";
+    }
+    return "unknown status";
+} /* end */
+
+/**
+ * Loads a program (the text format, or a binary image for this word width) and resets the handle
+ * Nothing changes when the program doesn't load
+ *
+ * @param sim handle
+ * @param data program bytes
+ * @param size length of data
+ * @return CPU_MEM_FINISHED, or CPU_MEM_BAD_ARGUMENT, CPU_MEM_BAD_IMAGE, CPU_MEM_NO_MEMORY
+ */
+int cpuMemLoad(CpuMem *sim, void const *data, size_t size) {
+    if (sim == NULL || data == NULL || size == 0)
+        return CPU_MEM_BAD_ARGUMENT;
+
+    // fmemopen only reads from the buffer in "r" mode
+    FILE *fp = fmemopen((void *)data, size, "r");
+    if (fp == NULL)
+        return CPU_MEM_NO_MEMORY;
+
+    Word image[PARTITION_WORDS] = { 0 };
+    char *error = loadProgram(fp, image);
+    fclose(fp);
+    if (error != NULL)
+        return CPU_MEM_BAD_IMAGE;
+
+    loadSimulator((Simulator *)sim, image);
+    return CPU_MEM_FINISHED;
+} /* end */
+
+/**
+ * Opens a translation written by cpu_mem_aot -o
+ *
+ * @param path shared object
+ * @param translation set to the translation
+ * @return CPU_MEM_FINISHED, or CPU_MEM_BAD_ARGUMENT, CPU_MEM_BAD_IMAGE (not a translation, or
+ *         for another word width), CPU_MEM_NO_MEMORY
+ */
+int cpuMemOpenTranslation(char const *path, CpuMemTranslation **translation) {
+    if (path == NULL || translation == NULL)
+        return CPU_MEM_BAD_ARGUMENT;
+
+    Translation *loaded = malloc(sizeof(Translation));
+    if (loaded == NULL)
+        return CPU_MEM_NO_MEMORY;
+
+    if (loadTranslation(path, loaded) != NULL) {
+        free(loaded);
+        return CPU_MEM_BAD_IMAGE;
+    }
+
+    *translation = (CpuMemTranslation *)loaded;
+    return CPU_MEM_FINISHED;
+} /* end */
+
+/**
+ * Points at the output kept since the last load or reset (when no output function is set)
+ *
+ * @param sim handle
+ * @param text set to the output, null terminated
+ * @param length set to its length in bytes (a char output of 0 is kept too)
+ * @return CPU_MEM_FINISHED, or CPU_MEM_BAD_ARGUMENT
+ */
+int cpuMemOutputText(CpuMem const *sim, char const **text, size_t *length) {
+    if (sim == NULL || text == NULL || length == NULL)
+        return CPU_MEM_BAD_ARGUMENT;
+
+    Simulator const *simulator = (Simulator const *)sim;
+    *text = simulator->output;
+    *length = simulator->outputLength;
+    return CPU_MEM_FINISHED;
+} /* end */
+
+/**
+ * Copies words out of guest memory
+ *
+ * @param sim handle
+ * @param address first word, in [0, CPU_MEM_WORDS)
+ * @param count words to copy, the range ending by CPU_MEM_WORDS
+ * @param words set to the values
+ * @return CPU_MEM_FINISHED, or CPU_MEM_BAD_ARGUMENT
+ */
+int cpuMemReadMemory(CpuMem const *sim, int address, int count, int64_t *words) {
+    if (sim == NULL || words == NULL || address < 0 || count < 0 || count > PARTITION_WORDS - address)
+        return CPU_MEM_BAD_ARGUMENT;
+
+    Simulator const *simulator = (Simulator const *)sim;
+    for (int i = 0; i < count; i++)
+        words[i] = simulator->image[address + i];
+    return CPU_MEM_FINISHED;
+} /* end */
+
+/**
+ * Copies the registers as the last run left them
+ *
+ * @param sim handle
+ * @param registers set to the registers
+ * @return CPU_MEM_FINISHED, or CPU_MEM_BAD_ARGUMENT
+ */
+int cpuMemRegisters(CpuMem const *sim, CpuMemRegisters *registers) {
+    if (sim == NULL || registers == NULL)
+        return CPU_MEM_BAD_ARGUMENT;
+
+    ProcessControlBlock const *process = &((Simulator const *)sim)->process;
+    registers->PC = process->PC;
+    registers->SP = process->SP;
+    registers->AC = process->AC;
+    registers->X = process->X;
+    registers->Y = process->Y;
+    registers->timer = process->timer;
+    registers->kernelMode = process->kernelMode;
+    registers->finished = process->finished;
+    return CPU_MEM_FINISHED;
+} /* end */
+
+/**
+ * Releases the calling thread's handle memory, once every handle it created is destroyed
+ *
+ * @return CPU_MEM_FINISHED, or CPU_MEM_BAD_ARGUMENT while handles are in use
+ */
+int cpuMemReleaseThread(void) {
+    return freeSimulatorArena() ? CPU_MEM_FINISHED : CPU_MEM_BAD_ARGUMENT;
+} /* end */
+
+/**
+ * Puts memory back to the loaded program and starts it over, keeping the interrupt interval
+ * and output function
+ *
+ * @param sim handle
+ * @return CPU_MEM_FINISHED, or CPU_MEM_BAD_ARGUMENT
+ */
+int cpuMemReset(CpuMem *sim) {
+    if (sim == NULL)
+        return CPU_MEM_BAD_ARGUMENT;
+
+    resetSimulator((Simulator *)sim);
+    return CPU_MEM_FINISHED;
+} /* end */
+
+/**
+ * Runs the program until it ends or stops, or for a number of instructions; a run that stopped
+ * on the instruction limit picks up where it stopped
+ *
+ * @param sim handle
+ * @param instructions most instructions to run, 0 for no limit
+ * @param executed set to the instructions this call ran (may be NULL)
+ * @return how the run ended (CPU_MEM_FINISHED once the program has ended), or CPU_MEM_BAD_ARGUMENT
+ */
+int cpuMemRun(CpuMem *sim, long instructions, long *executed) {
+    if (sim == NULL || instructions < 0)
+        return CPU_MEM_BAD_ARGUMENT;
+
+    Simulator *simulator = (Simulator *)sim;
+    RunStatus status = runSimulator(simulator, instructions);
+    if (executed != NULL)
+        *executed = simulator->metrics.instructions;
+    return status;
+} /* end */
+
+/**
+ * Sets the timer interrupt interval; a run in progress picks it up at its next call
+ *
+ * @param sim handle
+ * @param interval instructions between timer interrupts, at least 1
+ * @return CPU_MEM_FINISHED, or CPU_MEM_BAD_ARGUMENT
+ */
+int cpuMemSetInterrupt(CpuMem *sim, int interval) {
+    if (sim == NULL || interval < 1)
+        return CPU_MEM_BAD_ARGUMENT;
+
+    ((Simulator *)sim)->interrupt = interval;
+    return CPU_MEM_FINISHED;
+} /* end */
+
+/**
+ * Sends guest output to a function as it happens, instead of keeping it in the handle
+ *
+ * @param sim handle
+ * @param output function to call, NULL to keep output in the handle again
+ * @param context passed to output
+ * @return CPU_MEM_FINISHED, or CPU_MEM_BAD_ARGUMENT
+ */
+int cpuMemSetOutput(CpuMem *sim, CpuMemOutput output, void *context) {
+    if (sim == NULL)
+        return CPU_MEM_BAD_ARGUMENT;
+
+    Simulator *simulator = (Simulator *)sim;
+    simulator->outputFunction = output;
+    simulator->outputContext = context;
+    return CPU_MEM_FINISHED;
+} /* end */
+
+/**
+ * Runs a handle's program on a translation of it from now on (native code for what it can, the
+ * interpreter for the rest); loading another program detaches it
+ *
+ * @param sim handle
+ * @param translation translation of the loaded program, NULL to only interpret
+ * @return CPU_MEM_FINISHED, or CPU_MEM_BAD_ARGUMENT, CPU_MEM_BAD_IMAGE (another program's)
+ */
+int cpuMemSetTranslation(CpuMem *sim, CpuMemTranslation const *translation) {
+    if (sim == NULL)
+        return CPU_MEM_BAD_ARGUMENT;
+
+    if (attachTranslation((Simulator *)sim, (Translation const *)translation) != NULL)
+        return CPU_MEM_BAD_IMAGE;
+    return CPU_MEM_FINISHED;
+} /* end */
+
+/**
+ * Returns the guest word width the library was built with (registers and memory wrap at it)
+ *
+ * @return 32 or 64
+ */
+int cpuMemWordBits(void) {
+    return WORD_BITS;
+} /* end */
+
+/**
+ * Creates a handle with empty memory and a timer interrupt every 10000 instructions
+ *
+ * @return handle, NULL when out of memory
+ */
+CpuMem *cpuMemCreate(void) {
+    return (CpuMem *)createSimulator(emptyImage, 10000);
+} /* end */
+
+/**
+ * Closes a translation once no handle uses it
+ *
+ * @param translation from cpuMemOpenTranslation (NULL does nothing)
+ */
+void cpuMemCloseTranslation(CpuMemTranslation *translation) {
+    if (translation != NULL) {
+        freeTranslation((Translation *)translation);
+        free(translation);
+    }
+} /* end */
+
+/**
+ * Destroys a handle created on this thread
+ *
+ * @param sim handle (NULL does nothing)
+ */
+void cpuMemDestroy(CpuMem *sim) {
+    if (sim != NULL)
+        destroySimulator((Simulator *)sim);
+} /* end */
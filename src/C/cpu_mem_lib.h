@@ -0,0 +1,77 @@
+#ifndef CPU_MEM_LIB_H_
+#define CPU_MEM_LIB_H_
+
+// public interface of libcpumem: the simulator in the calling process, behind an opaque handle;
+// nothing here depends on the guest word width, and no call exits the process
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define CPU_MEM_API __attribute__((visibility("default")))
+#else
+#define CPU_MEM_API
+#endif
+
+// how a run ended (0 to 9), or why a call failed (negative)
+#define CPU_MEM_FINISHED 0
+#define CPU_MEM_INSTRUCTION_LIMIT 1
+#define CPU_MEM_TIME_LIMIT 2
+#define CPU_MEM_ACCESS_LIMIT 3
+#define CPU_MEM_INVALID_OPCODE 4
+#define CPU_MEM_MEMORY_FAULT 5
+#define CPU_MEM_DIVIDE_FAULT 6
+#define CPU_MEM_NESTING_LIMIT 7
+#define CPU_MEM_FRAME_FAULT 8
+#define CPU_MEM_VECTOR_FAULT 9
+#define CPU_MEM_BAD_ARGUMENT -1
+#define CPU_MEM_BAD_IMAGE -2
+#define CPU_MEM_NO_MEMORY -3
+
+// words of guest memory (user program, then system code from address 1000)
+#define CPU_MEM_WORDS 2000
+
+typedef struct CpuMem CpuMem;
+
+// a program translated ahead of time by cpu_mem_aot, shared by any number of handles
+typedef struct CpuMemTranslation CpuMemTranslation;
+
+typedef struct CpuMemRegisters {
+    int64_t PC, SP, AC, X, Y;
+    int64_t timer;
+    int kernelMode;
+    int finished;
+} CpuMemRegisters;
+
+// receives guest output (port 1 is an int, port 2 a char); without one, output is kept in the handle
+typedef void (*CpuMemOutput)(void *context, int port, int64_t value);
+
+CPU_MEM_API char const *cpuMemStatusMessage(int status);
+
+CPU_MEM_API int cpuMemLoad(CpuMem *sim, void const *data, size_t size);
+CPU_MEM_API int cpuMemOpenTranslation(char const *path, CpuMemTranslation **translation);
+CPU_MEM_API int cpuMemOutputText(CpuMem const *sim, char const **text, size_t *length);
+CPU_MEM_API int cpuMemReadMemory(CpuMem const *sim, int address, int count, int64_t *words);
+CPU_MEM_API int cpuMemRegisters(CpuMem const *sim, CpuMemRegisters *registers);
+CPU_MEM_API int cpuMemReleaseThread(void);
+CPU_MEM_API int cpuMemReset(CpuMem *sim);
+CPU_MEM_API int cpuMemRun(CpuMem *sim, long instructions, long *executed);
+CPU_MEM_API int cpuMemSetInterrupt(CpuMem *sim, int interval);
+CPU_MEM_API int cpuMemSetOutput(CpuMem *sim, CpuMemOutput output, void *context);
+CPU_MEM_API int cpuMemSetTranslation(CpuMem *sim, CpuMemTranslation const *translation);
+CPU_MEM_API int cpuMemWordBits(void);
+
+CPU_MEM_API CpuMem *cpuMemCreate(void);
+
+CPU_MEM_API void cpuMemCloseTranslation(CpuMemTranslation *translation);
+CPU_MEM_API void cpuMemDestroy(CpuMem *sim);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
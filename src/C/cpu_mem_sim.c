@@ -1,42 +1,193 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdbool.h> 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 #include "cpu_mem_sim.h"
 
+// the fuzzing harness (cpu_mem_fuzz.c) and translator (cpu_mem_aot.c) bring their own main, and the 
+// library (cpu_mem_lib.c) has none
+#if !defined(FUZZING) && !defined(CPU_MEM_LIBRARY) && !defined(CPU_MEM_AOT)
 /**
  * main
  * 
  * Exits if command line arguments aren't correct length (less than 2)
- * Sets values for filename and interrupt (interrupt default is 10,000)
+ * Sets values for filename(s) and interrupt (interrupt default is 10,000)
  * Creates two pipes
  * Creates a child process (memory process)
  * 
+ * Usage: cpu_mem_sim file [interrupt]
+ *        cpu_mem_sim [-i interrupt] [-s rr|priority|lottery] [-V vectorTable] [-p priorities] 
+ *                    [-m mask] [-g | -G socketPath] [-R interval[:words]] [-F profileFile [-n period]] [-H] 
+ *                    [-D socketPath] [-L instructions] [-T milliseconds] [-A accesses] [-J jsonFile] 
+ *                    [-P prometheusFile] file[:priority] ...
+ * 
+ * Exits with 0 when every program ends, 1 on an error, and 2 when a run limit stops the programs
+ * 
  * @param argc holds count for command line arguments  
  * @param argv holds values from command line entries
  */
 int main(int argc, char **argv) {
     int returnStatus = 0;
-    int interrupt;
-    char const *fileName;
-
-    // checking argument counts, setting values
-    if (argc == 3) {
-        fileName = argv[1];
-        interrupt = atoi(argv[2]);
-    }
-    else if (argc == 2) {
-        fileName = argv[1];
-        interrupt = 10000;
-    } 
-    else {
+    int interrupt = 10000;
+    int option;
+    SchedulerPolicy policy = ROUND_ROBIN;
+    int vectorTable = 0;
+    unsigned int hostMask = 0;
+    int interruptPriority[IRQ_SOURCES] = { 0, 1, 2, 3 };
+    bool debug = false;
+    char const *debugSocket = NULL;
+    int historyInterval = 0;
+    long undoWords = 0;
+    char const *profileFile = NULL;
+    int profilePeriod = 1;
+    bool countPerf = false;
+    char const *daemonSocket = NULL;
+    RunLimits limits = { 0 };
+    MetricsExport metricsExport = { NULL, NULL };
+
+    // checking options, setting values
+    while ((option = getopt(argc, argv, "i:s:V:p:m:gG:R:F:n:HD:L:T:A:J:P:")) != -1) {
+        switch (option) {
+            case 'i':
+                interrupt = atoi(optarg);
+                break;
+            case 's':
+                policy = parseSchedulerPolicy(optarg);
+                break;
+            case 'V':
+                vectorTable = atoi(optarg);
+                if (!validateAddressAccess(vectorTable, true) || 
+                    !validateAddressAccess(vectorTable + IRQ_SOURCES, true))
+                    errorExit("vector table must be in system memory");
+                break;
+            case 'p':
+                parseInterruptPriorities(optarg, interruptPriority);
+                break;
+            case 'm':
+                hostMask = strtoul(optarg, NULL, 0);
+                break;
+            case 'g':
+                debug = true;
+                break;
+            case 'G':
+                debug = true;
+                debugSocket = optarg;
+                break;
+            case 'R':
+                // snapshot interval, then words of memory writes that can be undone
+                historyInterval = atoi(optarg);
+                undoWords = (strchr(optarg, ':') != NULL) ? atol(strchr(optarg, ':') + 1) : HISTORY_UNDO_WORDS;
+                if (historyInterval <= 0 || undoWords <= 0 || undoWords > INT_MAX)
+                    errorExit("history interval and undo words must be positive numbers");
+                break;
+            case 'F':
+                profileFile = optarg;
+                break;
+            case 'n':
+                profilePeriod = atoi(optarg);
+                if (profilePeriod <= 0)
+                    errorExit("profile period must be a positive number");
+                break;
+            case 'H':
+                countPerf = true;
+                break;
+            case 'D':
+                daemonSocket = optarg;
+                break;
+            case 'L':
+                limits.instructions = atol(optarg);
+                break;
+            case 'T':
+                limits.wallNs = atol(optarg) * 1000000L;
+                break;
+            case 'A':
+                limits.memoryAccesses = atol(optarg);
+                break;
+            case 'J':
+                metricsExport.jsonFile = optarg;
+                break;
+            case 'P':
+                metricsExport.prometheusFile = optarg;
+                break;
+            default:
+                errorExit("unknown option");
+        }
+    }
+
+    int fileCount = argc - optind;
+    char **fileNames = argv + optind;
+
+    // original form: file [interrupt]
+    if (fileCount == 2 && access(fileNames[1], F_OK) != 0 && isNumber(fileNames[1])) {
+        interrupt = atoi(fileNames[1]);
+        fileCount = 1;
+    }
+
+    if (fileCount < 1)
         errorExit("wrong number of arguments");
+
+    if (interrupt <= 0)
+        errorExit("interrupt must be a positive number");
+
+    if (daemonSocket != NULL && (debug || profileFile != NULL || countPerf))
+        errorExit("-D can't be combined with -g, -G, -F or -H");
+
+    // going back replays with the profiler's shadow stacks out of step, so the two don't mix
+    if (historyInterval > 0 && (!debug || profileFile != NULL))
+        errorExit("-R needs -g or -G, and can't be combined with -F");
+
+    if (limits.instructions < 0 || limits.wallNs < 0 || limits.memoryAccesses < 0)
+        errorExit("run limits must be positive numbers");
+
+    // the watchdog only runs when some limit is set
+    bool limited = limits.instructions > 0 || limits.wallNs > 0 || limits.memoryAccesses > 0;
+    bool exporting = metricsExport.jsonFile != NULL || metricsExport.prometheusFile != NULL;
+
+    ProcessControlBlock *processTable = calloc(fileCount, sizeof(ProcessControlBlock));
+    if (processTable == NULL)
+        errorExit("calloc() failed");
+
+    // each file becomes a process; an optional :priority suffix sets its priority
+    for (int i = 0; i < fileCount; i++) {
+        processTable[i].priority = splitPriority(fileNames[i]);
+        processTable[i].fileName = fileNames[i];
+
+        if (access(fileNames[i], F_OK) != 0)
+            errorExit("wrong file name or no file");
+    }
+
+    // a file that won't load (a bad line, an image for the other word width) fails here, with 
+    // status 1, instead of in the memory process with the CPU left writing to a closed pipe
+    Word *scratch = malloc(getPartitionSize() * sizeof(Word));
+    if (scratch == NULL)
+        errorExit("malloc() failed");
+    for (int i = 0; i < fileCount; i++) {
+        memset(scratch, 0, getPartitionSize() * sizeof(Word));
+        validateFile(scratch, fileNames[i]);
     }
+    free(scratch);
+
+    Scheduler scheduler;
+    initScheduler(&scheduler, policy, processTable, fileCount);
 
-    if (access(fileName, F_OK) != 0)
-        errorExit("wrong file name or no file");
+    InterruptController controller;
+    initInterruptController(&controller, interruptPriority, hostMask, vectorTable);
 
     int cpuToMemory[2];
     int memoryToCPU[2];
@@ -50,98 +201,464 @@ int main(int argc, char **argv) {
     // memory -- child
     pid_t childPid = fork();
     if (childPid == 0) {
-        memoryProcess(cpuToMemory, memoryToCPU, fileName);
+        PerfCounters memoryCounters;
+        memoryProcess(cpuToMemory, memoryToCPU, (char const **)fileNames, fileCount, 
+                      countPerf ? &memoryCounters : NULL, daemonSocket != NULL, undoWords);
         exit(0);
     }
     // cpu -- parent
     else {
-        cpuProcess(cpuToMemory, memoryToCPU, interrupt);
+        closePipes(cpuToMemory, memoryToCPU, 0, 1);
+
+        // resident mode: memory stays up between runs, clients send patches over the socket
+        if (daemonSocket != NULL) {
+            runDaemon(daemonSocket, cpuToMemory, memoryToCPU, interrupt, &scheduler, &controller, 
+                      limited ? &limits : NULL, exporting ? &metricsExport : NULL);
+            pipeStatus(cpuToMemory, getExitStatus());
+            waitpid(childPid, &returnStatus, 0);
+            closePipes(cpuToMemory, memoryToCPU, 1, 0);
+            free(processTable);
+            return 0;
+        }
+
+        Debugger debugger;
+        if (debug)
+            initDebugger(&debugger, debugSocket);
+
+        // snapshots and the random log stay on the heap (the snapshot ring alone is most of a megabyte)
+        History *history = NULL;
+        if (historyInterval > 0) {
+            history = malloc(sizeof(History));
+            if (history == NULL)
+                errorExit("malloc() failed");
+            initHistory(history, historyInterval, undoWords, fileCount);
+            debugger.history = history;
+        }
+
+        Profiler profiler;
+        if (profileFile != NULL)
+            initProfiler(&profiler, profilePeriod, fileCount);
+
+        // counters run around cpuProcess() only; the memory process counts its own request loop
+        PerfCounters cpuCounters, memoryCounters;
+        struct timespec started, finished;
+        if (countPerf)
+            openPerfCounters(&cpuCounters);
+        clock_gettime(CLOCK_MONOTONIC, &started);
+
+        MemoryBus bus = { cpuToMemory, memoryToCPU, debug ? &debugger : NULL, NULL, NULL, 0, 0, 0, 
+                          { { 0 } }, 0, NULL, NULL, NULL, NULL };
+        Metrics metrics;
+        RunStatus status = cpuProcess(&bus, interrupt, &scheduler, &controller, limited ? &limits : NULL,
+                                      &metrics, profileFile != NULL ? &profiler : NULL, NULL);
+
+        // however the run ended, memory gets the exit signal and the reports cover what ran
+        if (exporting)
+            readMemoryMetrics(cpuToMemory, memoryToCPU, &metrics);
+        pipeStatus(cpuToMemory, getExitStatus());
+
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        if (countPerf) {
+            readPerfCounters(&cpuCounters);
+            if (read(memoryToCPU[0], &memoryCounters, sizeof(memoryCounters)) != sizeof(memoryCounters))
+                errorExit("memory to cpu read() failed");
+        }
         waitpid(childPid, &returnStatus, 0);
-    }
+        closePipes(cpuToMemory, memoryToCPU, 1, 0);
+
+        // partial statistics when a limit stopped the programs
+        if (fileCount > 1 || (limited && status != RUN_FINISHED))
+            printSchedulerReport(&scheduler);
+
+        if (profileFile != NULL) {
+            writeProfile(&profiler, &scheduler, profileFile);
+            freeProfiler(&profiler);
+        }
+
+        if (countPerf)
+            printPerfReport(&cpuCounters, &memoryCounters, &scheduler, elapsedNanoseconds(&started, &finished));
 
-    return 0;
+        if (exporting)
+            exportMetrics(&metricsExport, &scheduler, status, &metrics);
+
+        if (limited)
+            printRunReport(status, &metrics);
+
+        if (history != NULL) {
+            freeHistory(history);
+            free(history);
+        }
+
+        free(processTable);
+        if (status >= RUN_INVALID_OPCODE)
+            errorExit(runStatusMessage(status));
+        return status == RUN_FINISHED ? 0 : 2;
+    }
 } /* end main */
+#endif
 
 /**
  * Acts as memory (child process)
  * Validates file input
  * 
+ * Every file is loaded into its own partition (getPartitionSize() words).
+ * The CPU selects the partition that later reads and writes use with the switch status.
+ * 
  * @param cpuToMemory is for piping from CPU to Memory
  * @param memoryToCPU is for piping from Memory to CPU
- * @param fileName holds filename value user entered
+ * @param fileNames holds filename values user entered
+ * @param fileCount number of files (partitions)
+ * @param counters host counters for the request loop, sent to the CPU after exit (NULL when not counting)
+ * @param resident keep a pristine copy of the loaded image for patch and reload requests (daemon mode)
+ * @param undoWords old values of this many writes are kept for undo requests (0 keeps none)
  */
-void memoryProcess(int *cpuToMemory, int *memoryToCPU, char const *fileName) {
-    int memoryArray[2000] = {0};
-
-    // validate and process file
-    validateFile(memoryArray, fileName);
+void memoryProcess(int *cpuToMemory, int *memoryToCPU, char const **fileNames, int fileCount, 
+                   PerfCounters *counters, bool resident, long undoWords) {
+    int const partitionSize = getPartitionSize();
+    Word *memoryArray = calloc((size_t)fileCount * partitionSize, sizeof(Word));
+    if (memoryArray == NULL)
+        errorExit("calloc() failed");
+
+    // validate and process files
+    for (int i = 0; i < fileCount; i++) {
+        validateFile(memoryArray + (size_t)i * partitionSize, fileNames[i]);
+    }
     closePipes(cpuToMemory, memoryToCPU, 1, 0);
 
-    int ptr, tempValue;
-    int currentStatus = 0;
-    int const exitStatus = 99;
+    // patches go to both copies; reload copies the pristine image back over the one programs changed
+    size_t const imageSize = (size_t)fileCount * partitionSize * sizeof(Word);
+    Word *pristine = NULL;
+    if (resident) {
+        pristine = malloc(imageSize);
+        if (pristine == NULL)
+            errorExit("malloc() failed");
+        memcpy(pristine, memoryArray, imageSize);
+    }
+
+    // reverse execution: every write logs the word's old value first, and undo puts them back
+    UndoLog undo = { NULL, undoWords, 0 };
+    if (undoWords > 0) {
+        undo.entries = malloc(undoWords * sizeof(UndoEntry));
+        if (undo.entries == NULL)
+            errorExit("malloc() failed");
+    }
+
+    Word ptr, tempValue;
+    Word currentStatus = 0;
+    int const exitStatus = getExitStatus();
+    Word *partition = memoryArray;
 
-    // read = 82, write = 87 (ascii for r, w)
+    // pipe calls made here since the CPU last asked for metrics
+    Metrics metrics = { 0 };
+
+    // read = 82, write = 87, switch = 83, copy = 67, fill = 70, patch = 80, reload = 76, metrics = 77, 
+    // fetch = 73, undo = 85 (ascii for R, W, S, C, F, P, L, M, I, U)
     int const readStatus = getReadStatus();
     int const writeStatus = getWriteStatus();
+    int const switchStatus = getSwitchStatus();
+    int const copyStatus = getCopyStatus();
+    int const fillStatus = getFillStatus();
+    int const patchStatus = getPatchStatus();
+    int const reloadStatus = getReloadStatus();
+    int const metricsStatus = getMetricsStatus();
+    int const fetchStatus = getFetchStatus();
+    int const undoStatus = getUndoStatus();
+
+    if (counters != NULL)
+        openPerfCounters(counters);
     
     // continue until cpu process sends exit signal, 99
     while (currentStatus != exitStatus) {
         currentStatus = readFromCPU(cpuToMemory);
+        metrics.memoryTransportCalls += 1;
 
         // if cpu wants to read from memory, write back value at address
         if (currentStatus == readStatus) {
             ptr = readFromCPU(cpuToMemory);
-            writeToCPU(memoryToCPU, memoryArray, ptr);
+            writeToCPU(memoryToCPU, partition, ptr);
+            metrics.memoryTransportCalls += 2;
+        }
+
+        // instruction fetch: write back the values at ptr and ptr + 1 together (0 past the partition)
+        if (currentStatus == fetchStatus) {
+            ptr = readFromCPU(cpuToMemory);
+            Word words[2] = { partition[ptr], (ptr + 1 < partitionSize) ? partition[ptr + 1] : 0 };
+            if (write(memoryToCPU[1], words, sizeof(words)) == -1)
+                errorExit("memory to cpu write() failed");
+            metrics.memoryTransportCalls += 2;
         }
 
         // if cpu wants to write to memory, get ptr & value, and update address
         if (currentStatus == writeStatus) {
             ptr = readFromCPU(cpuToMemory);
             tempValue = readFromCPU(cpuToMemory);
-            memoryArray[ptr] = tempValue;
+            if (undo.entries != NULL)
+                recordUndo(&undo, memoryArray, (partition - memoryArray) + ptr);
+            partition[ptr] = tempValue;
+            metrics.memoryTransportCalls += 2;
         }
+
+        // block copy: source, destination, and count, already validated by the cpu
+        if (currentStatus == copyStatus) {
+            metrics.memoryTransportCalls += 3;
+            ptr = readFromCPU(cpuToMemory);
+            tempValue = readFromCPU(cpuToMemory);
+            Word count = readFromCPU(cpuToMemory);
+            for (Word i = 0; undo.entries != NULL && i < count; i++)
+                recordUndo(&undo, memoryArray, (partition - memoryArray) + tempValue + i);
+            memmove(partition + tempValue, partition + ptr, count * sizeof(Word));
+        }
+
+        // block fill: destination, count, and value
+        if (currentStatus == fillStatus) {
+            metrics.memoryTransportCalls += 3;
+            ptr = readFromCPU(cpuToMemory);
+            Word count = readFromCPU(cpuToMemory);
+            tempValue = readFromCPU(cpuToMemory);
+            for (Word i = 0; undo.entries != NULL && i < count; i++)
+                recordUndo(&undo, memoryArray, (partition - memoryArray) + ptr + i);
+            for (Word i = 0; i < count; i++)
+                partition[ptr + i] = tempValue;
+        }
+
+        // undo: put back the old values of the last count writes, newest first
+        if (currentStatus == undoStatus && undo.entries != NULL) {
+            metrics.memoryTransportCalls += 1;
+            ptr = readFromCPU(cpuToMemory);
+            rewindUndo(&undo, memoryArray, ptr);
+        }
+
+        // if cpu switched processes, get partition index, and point at its partition
+        if (currentStatus == switchStatus) {
+            metrics.memoryTransportCalls += 1;
+            ptr = readFromCPU(cpuToMemory);
+            partition = memoryArray + (size_t)ptr * partitionSize;
+        }
+
+        // daemon patch: get ptr & value, and update both the image and the pristine copy
+        if (currentStatus == patchStatus && pristine != NULL) {
+            metrics.memoryTransportCalls += 2;
+            ptr = readFromCPU(cpuToMemory);
+            tempValue = readFromCPU(cpuToMemory);
+            partition[ptr] = tempValue;
+            pristine[(partition - memoryArray) + ptr] = tempValue;
+        }
+
+        // daemon reload: every partition back to its pristine image, memory back on partition 0
+        if (currentStatus == reloadStatus && pristine != NULL) {
+            memcpy(memoryArray, pristine, imageSize);
+            partition = memoryArray;
+        }
+
+        // metrics: send this process's counts (the reply included), and start counting again
+        if (currentStatus == metricsStatus) {
+            metrics.memoryTransportCalls += 1;
+            if (write(memoryToCPU[1], &metrics, sizeof(metrics)) != sizeof(metrics))
+                errorExit("memory to cpu write() failed");
+            memset(&metrics, 0, sizeof(metrics));
+        }
+    }
+
+    if (counters != NULL) {
+        readPerfCounters(counters);
+        if (write(memoryToCPU[1], counters, sizeof(*counters)) != sizeof(*counters))
+            errorExit("memory to cpu write() failed");
     }
+
+    free(undo.entries);
+    free(pristine);
+    free(memoryArray);
 } /* end memoryProcess */
 
 /**
  * Acts as CPU (parent process)
  * 
- * @param cpuToMemory is for piping from CPU to Memory
- * @param memoryToCPU is for piping from Memory to CPU
+ * Runs every process in the scheduler's table. Each process keeps its own registers and timer,
+ * so a program sees the same timer interrupts it would see running alone. When a timer interrupt 
+ * fires and other processes are ready, the scheduler picks the next process once the interrupt 
+ * handler returns to user mode (case 30).
+ * 
+ * Errors a guest program can cause (a bad opcode, a fault without a handler) end the run and 
+ * come back as a status; the registers at that point are saved to the process control block.
+ * With a history, the debugger stops at such an error first, and can go back before it.
+ * 
+ * @param bus memory access for the CPU, and the debugger (NULL when not debugging)
  * @param interrupt holds value for when to interrupt processing
+ * @param scheduler holds the process table and ready queues
+ * @param controller holds interrupt priorities, masks, and vector table address
+ * @param limits instruction, wall clock, and memory access budgets (NULL for none)
+ * @param metrics set to what the run did, CPU side (NULL when not needed)
+ * @param profiler shadow call stacks and sample counts (NULL when not profiling)
+ * @param coverage edge counters (NULL when not fuzzing)
+ * @return RUN_FINISHED once every process ends, otherwise why the run stopped
  */
-void cpuProcess(int *cpuToMemory, int *memoryToCPU, int interrupt) {
-    closePipes(cpuToMemory, memoryToCPU, 0, 1);
+RunStatus cpuProcess(MemoryBus *bus, int interrupt, Scheduler *scheduler, InterruptController *controller, 
+                     RunLimits *limits, Metrics *metrics, Profiler *profiler, Coverage *coverage) {
+    Debugger *debugger = bus->debugger;
+    History *history = (debugger != NULL) ? debugger->history : NULL;
+
+    Word PC, SP, IR, AC, X, Y; 
+    Word tempValue, tempSP;
+    Word instructionPC, instructionSP;
+    long timer, nextTick;
+    long executed = 0;
+    long nextCheck = LONG_MAX;
+    Metrics counts = { 0 };
+    RunStatus status = RUN_FINISHED;
+    RunStatus faultStatus;
+    bool kernelMode;
+    unsigned char const *stopPoints = (limits != NULL) ? limits->stopPoints : NULL;
+
+    // memory starts out on partition 0, so the first process is dispatched without a switch
+    int current = pickNextProcess(scheduler);
+    ProcessControlBlock *process = &scheduler->table[current];
+    if (current != 0)
+        switchPartition(bus, current);
+
+    IR = 0;
+    PC = process->PC;
+    SP = process->SP;
+    AC = process->AC;
+    X = process->X;
+    Y = process->Y;
+    timer = process->timer;
+    nextTick = (timer / interrupt + 1) * interrupt;
+    kernelMode = process->kernelMode;
+    loadInterruptMask(controller, bus);
+
+    if (profiler != NULL)
+        profiler->stack = &profiler->stacks[current];
+
+    bool reschedule = false;
+    struct timespec dispatched, switchStarted;
+    clock_gettime(CLOCK_MONOTONIC, &dispatched);
+
+    // without limits the watchdog never runs; with them, it runs before the first instruction
+    struct timespec started = dispatched;
+    bus->reads = 0;
+    bus->writes = 0;
+    bus->transportCalls = 0;
+    if (limits != NULL) {
+        limits->started = started;
+        nextCheck = 0;
+    }
+
+    // Exit loop once the last process ends (case 50); the caller sends the exit signal (99) to memory
+resume:
+    while (true) {
+        /*
+            Going back restores the last snapshot at or before the instruction count asked for,
+            then replays up to it; the replay draws logged randoms and shows no output again.
+        */
+        if (history != NULL && debugger->travelTo >= 0) {
+            HistorySnapshot const *snapshot = findHistorySnapshot(history, bus, debugger->travelTo);
+            if (history->shownTo < executed)
+                history->shownTo = executed;
+            restoreHistory(history, snapshot, scheduler, controller, bus);
+
+            current = snapshot->current;
+            process = &scheduler->table[current];
+            PC = snapshot->registers.PC;
+            SP = snapshot->registers.SP;
+            IR = snapshot->registers.IR;
+            AC = snapshot->registers.AC;
+            X = snapshot->registers.X;
+            Y = snapshot->registers.Y;
+            timer = snapshot->registers.timer;
+            kernelMode = snapshot->registers.kernelMode;
+            executed = snapshot->registers.executed;
+            nextTick = snapshot->nextTick;
+            reschedule = snapshot->reschedule;
+            counts = snapshot->counts;
+            if (limits != NULL)
+                nextCheck = executed;
+            clock_gettime(CLOCK_MONOTONIC, &dispatched);
+
+            debugger->stepsLeft = debugger->travelTo - executed + 1;
+            debugger->travelTo = -1;
+            debugger->replaying = true;
+            debugger->watchHit = -1;
+        }
 
-    int PC, SP, IR, AC, X, Y; 
-    int tempValue, tempSP, timer;
+        // a snapshot every interval instructions, so going back replays fewer than that many
+        if (history != NULL && executed == history->nextSnapshot) {
+            HistorySnapshot *snapshot = saveHistory(history, scheduler, controller, bus);
+            Registers registers = { PC, SP, IR, AC, X, Y, timer, kernelMode, executed };
+            snapshot->registers = registers;
+            snapshot->current = current;
+            snapshot->nextTick = nextTick;
+            snapshot->reschedule = reschedule;
+            snapshot->counts = counts;
+        }
 
-    bool kernelMode = false;
-    PC = 0;
-    timer = 0;
+        // registers to restore if the instruction faults part way through
+        instructionPC = PC;
+        instructionSP = SP;
 
-    // SP set to 1000
-    SP = getMaxUserProgramEntry() + 1;
+        /*
+            Debug mode stops before the instruction at PC when a step count runs out,
+            PC has its breakpoint bit set, or the last instruction touched a watched address.
+            A replay stops only when its step count runs out.
+        */
+        if (debugger != NULL && 
+            ((debugger->stepsLeft > 0 && --debugger->stepsLeft == 0) || 
+             (!debugger->replaying && (debugger->watchHit >= 0 ||
+              ((UWord)PC < PARTITION_WORDS && testAddressBit(debugger->breakpoints, PC)))))) {
+            Registers registers = { PC, SP, IR, AC, X, Y, timer, kernelMode, executed };
+            debugPrompt(debugger, bus, current, &registers);
+            if (debugger->travelTo >= 0)
+                continue;
+        }
 
-    // read = 82, write = 87 (ascii for r, w)
-    int const readStatus = getReadStatus();
-    int const writeStatus = getWriteStatus();
+        // a translated program takes over again at its block starts (runTranslation)
+        if (stopPoints != NULL && executed > 0 && !kernelMode && (UWord)PC < PARTITION_WORDS && stopPoints[PC]) {
+            status = RUN_INSTRUCTION_LIMIT;
+            goto stopRun;
+        }
+
+        // budgets are checked every WATCHDOG_INSTRUCTIONS instructions, one compare per instruction otherwise
+        if (executed == nextCheck) {
+            status = checkRunLimits(limits, bus, executed, &nextCheck);
+            if (status != RUN_FINISHED)
+                goto stopRun;
+        }
+        executed += 1;
+        counts.kernelInstructions += kernelMode;
+
+        // fuzzing: count the edge from the last instruction to this one
+        if (coverage != NULL) {
+            unsigned int location = (unsigned int)PC * 40503u;
+            unsigned int edge = (location ^ coverage->previous) & (COVERAGE_EDGES - 1);
+            unsigned char hits = coverage->edges[edge];
+            if (hits == 0)
+                coverage->touched[coverage->touchedCount++] = edge;
+            if (hits != UCHAR_MAX)
+                coverage->edges[edge] = hits + 1;
+            coverage->previous = (location & (COVERAGE_EDGES - 1)) >> 1;
+        }
+
+        // every period instructions, charge the instruction about to run to the shadow call stack
+        if (profiler != NULL && --profiler->countdown == 0) {
+            profiler->countdown = profiler->period;
+            profiler->nodes[profiler->stack->node].samples += 1;
+        }
 
-    // Before exiting loop, CPU sends exit signal (99) to memory, in case 50
-    while (IR != 50) {
         /* 
             Validating memory accesses are OK to perform; dependent on kernelMode and ptr value.
             Exit if invalid.
         */
         if (validateAddressAccess(PC, kernelMode)) {
-            pipeReadStatusAndPTR(cpuToMemory, PC, readStatus);
-            IR = readFromMemory(memoryToCPU);
+            prefetchMemory(bus, PC);
+            IR = readMemory(bus, PC);
         }
         else {
-            errorExit("Memory violation: accessing address in wrong mode");
+            goto memoryFault;
         } 
 
+        // over the pipes, the next instruction is fetched (with its operand) while this one runs
+        if (bus->image == NULL)
+            prefetchMemory(bus, predictNextPC(bus, IR, PC, AC));
+
         /*
             Validate memory acceses with every read or write. Some cases have multiple validations. 
             Cases based on Instruction Register value (IR).
@@ -158,202 +675,146 @@ void cpuProcess(int *cpuToMemory, int *memoryToCPU, int interrupt) {
                 /* Load the value into the AC */
                 PC += 1;
                 if (validateAddressAccess(PC, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, PC, readStatus);
-                    AC = readFromMemory(memoryToCPU);
+                    AC = readMemory(bus, PC);
                 }
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
                 PC += 1;
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 2:
                 /* Load the value at the address into the AC */
                 PC += 1;
                 if (validateAddressAccess(PC, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, PC, readStatus);
-                    tempValue = readFromMemory(memoryToCPU);
+                    tempValue = readMemory(bus, PC);
                 }
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
                 if (validateAddressAccess(tempValue, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, tempValue, readStatus);
-                    AC = readFromMemory(memoryToCPU);
+                    AC = readMemory(bus, tempValue);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
                 PC += 1;
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 3:
                 /* Load the value from the address found in the given address into the AC */
                 PC += 1;
                 if (validateAddressAccess(PC, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, PC, readStatus);
-                    tempValue = readFromMemory(memoryToCPU);
+                    tempValue = readMemory(bus, PC);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
                 if (validateAddressAccess(tempValue, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, tempValue, readStatus);
-                    tempValue = readFromMemory(memoryToCPU);
+                    tempValue = readMemory(bus, tempValue);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
                 if (validateAddressAccess(tempValue, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, tempValue, readStatus);
-                    AC = readFromMemory(memoryToCPU);
+                    AC = readMemory(bus, tempValue);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
                 PC += 1;
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 4:
                 /* Load the value at (address+X) into the AC */
                 PC += 1;
                 if (validateAddressAccess(PC, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, PC, readStatus);
-                    tempValue = readFromMemory(memoryToCPU);
+                    tempValue = readMemory(bus, PC);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
-                tempValue += X;
+                tempValue = WORD_ADD(tempValue, X);
                 if (validateAddressAccess(tempValue, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, tempValue, readStatus);
-                    AC = readFromMemory(memoryToCPU);
+                    AC = readMemory(bus, tempValue);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
                 PC += 1;
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 5:
                 /* Load the value at (address+Y) into the AC */
                 PC += 1;
                 if (validateAddressAccess(PC, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, PC, readStatus);
-                    tempValue = readFromMemory(memoryToCPU);
+                    tempValue = readMemory(bus, PC);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
-                tempValue += Y;
+                tempValue = WORD_ADD(tempValue, Y);
                 if (validateAddressAccess(tempValue, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, tempValue, readStatus);
-                    AC = readFromMemory(memoryToCPU);
+                    AC = readMemory(bus, tempValue);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
                 PC += 1;
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 6:
                 /* Load from (Sp+X) into the AC. */
                 PC += 1;
-                int tempAddr = SP + X;
+                Word tempAddr = WORD_ADD(SP, X);
                 if (validateAddressAccess(tempAddr, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, tempAddr, readStatus);
-                    AC = readFromMemory(memoryToCPU);
+                    AC = readMemory(bus, tempAddr);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 7:
                 /* Store the value in the AC into the address */
                 PC += 1;
                 if (validateAddressAccess(PC, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, PC, readStatus);
-                    tempValue = readFromMemory(memoryToCPU);
+                    tempValue = readMemory(bus, PC);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
                 if (validateAddressAccess(tempValue, kernelMode)) {
-                    pipeAddressToStack(cpuToMemory, writeStatus, tempValue, AC);
+                    writeMemory(bus, tempValue, AC);
                 }                
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
                 PC += 1;
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 8:
                 /* Gets a random int from 1 to 100 into the AC */
                 PC += 1;
-                AC = randomInteger(PC);
+                // instances and fuzz runs draw from their own seed; only the command line uses rand()
+                if (bus->randomSeed != NULL)
+                    AC = nextRandom(bus->randomSeed) % 100 + 1;
+                else
+                    AC = (history != NULL) ? historyRandom(history, PC) : randomInteger(PC);
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 9:
@@ -362,75 +823,51 @@ void cpuProcess(int *cpuToMemory, int *memoryToCPU, int interrupt) {
                     If port = 2, writes AC as a char to the screen
                 */
                 PC += 1;
-                int port;
+                Word port;
                 if (validateAddressAccess(PC, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, PC, readStatus);
-                    port = readFromMemory(memoryToCPU);
+                    port = readMemory(bus, PC);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
-                showAC(port, AC);
-                PC += 1;
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
+                // a replay after going back doesn't show output again
+                if (history == NULL || executed > history->shownTo) {
+                    if (bus->output != NULL)
+                        bus->output(bus->outputContext, port, AC);
+                    else
+                        showAC(port, AC);
                 }
+                raiseInterrupt(controller, IRQ_DEVICE);
+                PC += 1;
                 break;
 
             case 10:
                 /* Add the value in X to the AC */
                 PC += 1;
-                AC += X;
+                AC = WORD_ADD(AC, X);
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 11:
                 /* Add the value in Y to the AC */
                 PC += 1;
-                AC += Y;
+                AC = WORD_ADD(AC, Y);
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 12:
                 /* Subtract the value in X from the AC */
                 PC += 1;
-                AC -= X;
+                AC = WORD_SUB(AC, X);
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 13:
                 /* Subtract the value in Y from the AC */
                 PC += 1;
-                AC -= Y;
+                AC = WORD_SUB(AC, Y);
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 14:
@@ -438,12 +875,6 @@ void cpuProcess(int *cpuToMemory, int *memoryToCPU, int interrupt) {
                 PC += 1;
                 X = AC;
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 15:
@@ -451,12 +882,6 @@ void cpuProcess(int *cpuToMemory, int *memoryToCPU, int interrupt) {
                 PC += 1;
                 AC = X;
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 16:
@@ -464,12 +889,6 @@ void cpuProcess(int *cpuToMemory, int *memoryToCPU, int interrupt) {
                 PC += 1;
                 Y = AC;
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 17:
@@ -477,12 +896,6 @@ void cpuProcess(int *cpuToMemory, int *memoryToCPU, int interrupt) {
                 PC += 1;
                 AC = Y;
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 18:
@@ -490,12 +903,6 @@ void cpuProcess(int *cpuToMemory, int *memoryToCPU, int interrupt) {
                 PC += 1;
                 SP = AC;
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 19:
@@ -503,31 +910,18 @@ void cpuProcess(int *cpuToMemory, int *memoryToCPU, int interrupt) {
                 PC += 1;
                 AC = SP;
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 20:
                 /* Jump to the address */
                 PC += 1;
                 if (validateAddressAccess(PC, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, PC, readStatus);
-                    PC = readFromMemory(memoryToCPU);
+                    PC = readMemory(bus, PC);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 21:
@@ -536,23 +930,16 @@ void cpuProcess(int *cpuToMemory, int *memoryToCPU, int interrupt) {
                 
                 if (AC == 0) {
                     if (validateAddressAccess(PC, kernelMode)) {
-                        pipeReadStatusAndPTR(cpuToMemory, PC, readStatus);
-                        PC = readFromMemory(memoryToCPU);
+                        PC = readMemory(bus, PC);
                     } 
                     else {
-                        errorExit("Memory violation: accessing address in wrong mode");
+                        goto memoryFault;
                     }
                 }
                 else {
                     PC += 1;
                 }
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 22:
@@ -561,244 +948,572 @@ void cpuProcess(int *cpuToMemory, int *memoryToCPU, int interrupt) {
                 
                 if (AC != 0) {
                     if (validateAddressAccess(PC, kernelMode)) {
-                        pipeReadStatusAndPTR(cpuToMemory, PC, readStatus);
-                        PC = readFromMemory(memoryToCPU);
+                        PC = readMemory(bus, PC);
                     } 
                     else {
-                        errorExit("Memory violation: accessing address in wrong mode");
+                        goto memoryFault;
                     }
                 }
                 else {
                     PC += 1;
                 }
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 23:
                 /* Push return address onto stack, jump to the address */
                 PC += 1;
-                SP -= 1;
+                SP = WORD_SUB(SP, 1);
 
                 if (validateAddressAccess(SP, kernelMode)) {
-                    pipeAddressToStack(cpuToMemory, writeStatus, SP, PC);
+                    writeMemory(bus, SP, PC);
                 }
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
                 if (validateAddressAccess(PC, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, PC, readStatus);
-                    PC = readFromMemory(memoryToCPU);
+                    PC = readMemory(bus, PC);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
+                // a call outside memory faults at the next fetch, so it gets no frame
+                if (profiler != NULL && (UWord)PC < PARTITION_WORDS)
+                    profileCall(profiler, PC, SP);
                 break;
 
             case 24:
                 /* Pop return address from the stack, jump to address */
+                if (profiler != NULL)
+                    profileReturn(profiler, SP);
+
                 PC = SP;
                 if (validateAddressAccess(PC, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, PC, readStatus);
-                    PC = readFromMemory(memoryToCPU);
+                    PC = readMemory(bus, PC);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
-                SP += 1;
-                PC += 1;
+                SP = WORD_ADD(SP, 1);
+                PC = WORD_ADD(PC, 1);
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 25:
                 /* Increment the value in X */
                 PC += 1;
-                X += 1;
+                X = WORD_ADD(X, 1);
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 26:
                 /* Decrement the value in X */
                 PC += 1;
-                X -= 1;
+                X = WORD_SUB(X, 1);
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 27:
                 /* Push AC onto stack */
                 PC += 1;
-                SP -= 1;
+                SP = WORD_SUB(SP, 1);
 
                 if (validateAddressAccess(SP, kernelMode)) {
-                    pipeAddressToStack(cpuToMemory, writeStatus, SP, AC);
+                    writeMemory(bus, SP, AC);
                 }
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
                 break;
 
             case 28:
                 /* Pop from stack into AC */
                 PC += 1;
                 if (validateAddressAccess(SP, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, SP, readStatus);
-                    AC = readFromMemory(memoryToCPU);
+                    AC = readMemory(bus, SP);
                 } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
-                SP += 1;
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
+                SP = WORD_ADD(SP, 1);
                 break;
 
             case 29:
-                /* Perform system call */
-                kernelMode = true;
+                /* Perform system call (taken below, like every other interrupt) */
                 PC += 1;
-                tempSP = getMaxSystemCodeEntry();
+                counts.syscalls += 1;
+                raiseInterrupt(controller, IRQ_SYSCALL);
+                break;
 
-                if (validateAddressAccess(tempSP, kernelMode)) {
-                    pipeAddressToStack(cpuToMemory, writeStatus, tempSP, PC);
-                }
+            case 30:
+                /* Return from system call */
+                if (validateAddressAccess(SP, kernelMode)) {
+                    tempSP = readMemory(bus, SP);
+                } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
-                tempSP -= 1;
-                if (validateAddressAccess(tempSP, kernelMode)) {
-                    pipeAddressToStack(cpuToMemory, writeStatus, tempSP, SP);
-                }
+                SP = WORD_ADD(SP, 1);
+                if (validateAddressAccess(SP, kernelMode)) {
+                    PC = readMemory(bus, SP);
+                } 
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
-                
+
                 SP = tempSP;
-                PC = 1500;
+                exitInterrupt(controller, bus);
+                kernelMode = controller->depth > 0;
 
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
-                }
+                if (profiler != NULL)
+                    profileInterruptReturn(profiler);
                 break;
 
-            case 30:
-                /* Return from system call */
-                if (validateAddressAccess(SP, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, SP, readStatus);
-                    tempSP = readFromMemory(memoryToCPU);
-                } 
+            case 31:
+                /* Multiply the AC by X (wraps around) */
+                PC += 1;
+                AC = WORD_MUL(AC, X);
+
+                break;
+
+            case 32:
+                /* Multiply the AC by Y (wraps around) */
+                PC += 1;
+                AC = WORD_MUL(AC, Y);
+
+                break;
+
+            case 33:
+                /* Divide the AC by X */
+                PC += 1;
+                if (X == 0)
+                    goto divideFault;
+                AC = X == -1 ? WORD_SUB(0, AC) : AC / X;
+
+                break;
+
+            case 34:
+                /* Divide the AC by Y */
+                PC += 1;
+                if (Y == 0)
+                    goto divideFault;
+                AC = Y == -1 ? WORD_SUB(0, AC) : AC / Y;
+
+                break;
+
+            case 35:
+                /* Remainder of the AC divided by X */
+                PC += 1;
+                if (X == 0)
+                    goto divideFault;
+                AC = X == -1 ? 0 : AC % X;
+
+                break;
+
+            case 36:
+                /* Remainder of the AC divided by Y */
+                PC += 1;
+                if (Y == 0)
+                    goto divideFault;
+                AC = Y == -1 ? 0 : AC % Y;
+
+                break;
+
+            case 37:
+                /* Shift the AC left by the value (0 to WORD_BITS - 1) */
+                PC += 1;
+                if (validateAddressAccess(PC, kernelMode)) {
+                    tempValue = readMemory(bus, PC);
+                }
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
-                SP += 1;
-                if (validateAddressAccess(SP, kernelMode)) {
-                    pipeReadStatusAndPTR(cpuToMemory, SP, readStatus);
-                    PC = readFromMemory(memoryToCPU);
-                } 
+                AC = (Word)((UWord)AC << (tempValue & (WORD_BITS - 1)));
+                PC += 1;
+                break;
+
+            case 38:
+                /* Shift the AC right by the value (0 to WORD_BITS - 1), keeping its sign */
+                PC += 1;
+                if (validateAddressAccess(PC, kernelMode)) {
+                    tempValue = readMemory(bus, PC);
+                }
                 else {
-                    errorExit("Memory violation: accessing address in wrong mode");
+                    goto memoryFault;
                 }
 
-                kernelMode = false;
-                SP = tempSP;
-                
-                timer += 1;
-                if (validateTimerInterrupt(interrupt, timer, kernelMode)) {
-                    kernelMode = true;
-                    PC = timerInterrupt(cpuToMemory, SP, PC, getMaxSystemCodeEntry());
-                    SP = getMaxSystemCodeEntry() - 1;
+                AC >>= tempValue & (WORD_BITS - 1);
+                PC += 1;
+                break;
+
+            case 39:
+                /* Bitwise and of the AC with X */
+                PC += 1;
+                AC &= X;
+
+                break;
+
+            case 40:
+                /* Bitwise or of the AC with X */
+                PC += 1;
+                AC |= X;
+
+                break;
+
+            case 41:
+                /* Bitwise exclusive or of the AC with X */
+                PC += 1;
+                AC ^= X;
+
+                break;
+
+            case 42:
+                /* Bitwise not of the AC */
+                PC += 1;
+                AC = ~AC;
+
+                break;
+
+            case 43:
+                /* Copy AC words from the address in X to the address in Y (ranges may overlap) */
+                PC += 1;
+                if (AC < 0 || 
+                    (AC > 0 && !(validateAddressRange(X, AC, kernelMode) && validateAddressRange(Y, AC, kernelMode)))) {
+                    goto memoryFault;
                 }
+
+                copyMemory(bus, X, Y, AC);
+
+                // up to two accesses a word: the access budget is checked before the next instruction
+                if (limits != NULL)
+                    nextCheck = executed;
+                break;
+
+            case 44:
+                /* Store X into AC words from the address in Y */
+                PC += 1;
+                if (AC < 0 || (AC > 0 && !validateAddressRange(Y, AC, kernelMode))) {
+                    goto memoryFault;
+                }
+
+                fillMemory(bus, Y, AC, X);
+                if (limits != NULL)
+                    nextCheck = executed;
                 break;
 
             case 50:
-                pipeReadStatusAndPTR(cpuToMemory, 0, 99);
+                /* End process */
+                process->finished = true;
+                scheduler->liveCount -= 1;
                 break;
 
             default:
-                errorExit("No case!");
+                status = RUN_INVALID_OPCODE;
+                goto stopRun;
+        }
+
+        /*
+            Timer counts completed instructions. A tick only latches while the timer 
+            can be taken, so ticks during a handler of equal or higher priority are lost.
+        */
+        if (IR != 50) {
+            timer += 1;
+            if (timer == nextTick) {
+                nextTick += interrupt;
+                raiseInterrupt(controller, IRQ_TIMER);
+            }
+        }
+        goto checkInterrupts;
+
+    divideFault:
+        faultStatus = RUN_DIVIDE_FAULT;
+        goto takeFault;
+
+    memoryFault:
+        /* 
+            A memory violation or division by zero aborts the instruction and raises a fault.
+            Without a fault handler (or inside one), the run stops as before.
+        */
+        faultStatus = RUN_MEMORY_FAULT;
+    takeFault:
+        PC = instructionPC;
+        SP = instructionSP;
+        IR = 0;
+        if (!raiseFault(controller, bus)) {
+            status = faultStatus;
+            goto stopRun;
+        }
+
+    checkInterrupts:
+        /*
+            Pending and enabled bits are in priority order, so one test covers every source.
+            SP and PC are saved on the system stack, then PC is set to the source's vector.
+        */
+        if (controller->pending & controller->enabled) {
+            int source = nextInterrupt(controller);
+            int vector = interruptVector(controller, bus, source);
+            if (vector < 0) {
+                status = RUN_VECTOR_FAULT;
+                goto stopRun;
+            }
+
+            if (vector != 0) {
+                status = enterInterrupt(controller, bus, source, vector, &SP, &PC);
+                if (status != RUN_FINISHED)
+                    goto stopRun;
+                kernelMode = true;
+                counts.interrupts[source] += 1;
+
+                if (profiler != NULL)
+                    profileInterrupt(profiler, source);
+
+                if (source == IRQ_TIMER && scheduler->liveCount > 1)
+                    reschedule = true;
+            }
+        }
+
+        /*
+            Switch processes when the current one ends, or when a timer interrupt 
+            asked for a reschedule and its handler has returned to user mode.
+            Registers of a preempted process are saved to its process control block.
+        */
+        if (IR == 50 || (reschedule && !kernelMode)) {
+            clock_gettime(CLOCK_MONOTONIC, &switchStarted);
+            process->cpuTimeNs += elapsedNanoseconds(&dispatched, &switchStarted);
+            process->timer = timer;
+
+            // an ended process keeps its last registers too, for the library to report
+            process->PC = PC;
+            process->SP = SP;
+            process->AC = AC;
+            process->X = X;
+            process->Y = Y;
+            process->kernelMode = kernelMode;
+
+            if (scheduler->liveCount == 0)
+                goto finishRun;
+
+            if (IR != 50)
+                enqueueProcess(scheduler, current);
+
+            // a priority scheduler may pick the preempted process again
+            int next = pickNextProcess(scheduler);
+            if (next != current) {
+                current = next;
+                process = &scheduler->table[current];
+                switchPartition(bus, current);
+
+                PC = process->PC;
+                SP = process->SP;
+                AC = process->AC;
+                X = process->X;
+                Y = process->Y;
+                timer = process->timer;
+                nextTick = (timer / interrupt + 1) * interrupt;
+                kernelMode = process->kernelMode;
+                resetInterruptController(controller);
+                loadInterruptMask(controller, bus);
+
+                if (profiler != NULL)
+                    profiler->stack = &profiler->stacks[current];
+
+                process->contextSwitches += 1;
+                scheduler->contextSwitches += 1;
+                clock_gettime(CLOCK_MONOTONIC, &dispatched);
+                scheduler->switchLatencyNs += elapsedNanoseconds(&switchStarted, &dispatched);
+            }
+            else {
+                dispatched = switchStarted;
+            }
+            reschedule = false;
+        }
+    }
+
+stopRun:
+    // with a history, a guest error stops in the debugger, where going back resumes the run
+    if (history != NULL && status >= RUN_INVALID_OPCODE) {
+        fflush(stdout);
+        fprintf(debugger->out, "\n%s\n", runStatusMessage(status));
+        Registers registers = { PC, SP, IR, AC, X, Y, timer, kernelMode, executed };
+        debugPrompt(debugger, bus, current, &registers);
+        if (debugger->travelTo >= 0) {
+            status = RUN_FINISHED;
+            goto resume;
         }
     }
+
+    // registers of the instruction that stopped the run, for reports and restarts
+    clock_gettime(CLOCK_MONOTONIC, &switchStarted);
+    process->cpuTimeNs += elapsedNanoseconds(&dispatched, &switchStarted);
+    process->PC = PC;
+    process->SP = SP;
+    process->AC = AC;
+    process->X = X;
+    process->Y = Y;
+    process->timer = timer;
+    process->kernelMode = kernelMode;
+
+finishRun:
+    // no reply left in the pipe, and no line kept for a later run (the daemon reloads memory between runs)
+    dropFetches(bus, 0, PARTITION_WORDS);
+
+    if (metrics != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &switchStarted);
+        counts.instructions = executed;
+        counts.memoryReads = bus->reads;
+        counts.memoryWrites = bus->writes;
+        counts.cpuTransportCalls = bus->transportCalls;
+        counts.elapsedNs = elapsedNanoseconds(&started, &switchStarted);
+        *metrics = counts;
+    }
+    return status;
 } /* end cpuProcess */
 
 /**
- * Confirms address access based on pointer value and mode state
+ * Checks that going back to a snapshot can still be undone: memory has kept every write since it,
+ * and the random log every number drawn since it
  * 
- * @param ptr to memory access
- * @param kernelMode current mode of CPU
+ * @param history snapshots and logs
+ * @param bus memory access for the CPU (its write count is where memory's undo log is now)
+ * @param snapshot to check
+ * @return true if the snapshot can be restored
+ */
+bool isHistoryValid(History *history, MemoryBus *bus, HistorySnapshot const *snapshot) {
+    long writeEnd = (bus->writes > history->writeEnd) ? bus->writes : history->writeEnd;
+    return writeEnd - snapshot->writes <= history->undoWords &&
+           history->randomEnd - snapshot->randoms <= HISTORY_RANDOMS;
+} /* end */
+
+/**
+ * Confirms a string holds only decimal digits
+ * 
+ * @param s string to check
  * @return true or false
  */
-bool validateAddressAccess(int ptr, bool kernelMode) {
-    if ((kernelMode == false && (ptr >= 0 && ptr <= 999)) ||
-        (kernelMode == true && (ptr >= 1000 && ptr <= 1999)))
-        return true;
-    else
+bool isNumber(char const *s) {
+    if (*s == '\0')
+        return false;
+
+    for (; *s != '\0'; s++) {
+        if (*s < '0' || *s > '9')
+            return false;
+    }
+    return true;
+} /* end */
+
+/**
+ * Raises a fault if a fault handler can take it
+ * A fault inside the fault handler (double fault) can't be taken
+ * 
+ * @param controller interrupt state
+ * @param bus memory access for the CPU
+ * @return true if the fault is pending, false if the program should exit
+ */
+bool raiseFault(InterruptController *controller, MemoryBus *bus) {
+    int const rank = controller->rank[IRQ_FAULT];
+    for (int i = 0; i < controller->depth; i++) {
+        if (controller->stack[i] == rank)
+            return false;
+    }
+
+    if (interruptVector(controller, bus, IRQ_FAULT) == 0)
         return false;
+
+    raiseInterrupt(controller, IRQ_FAULT);
+    return true;
+} /* end */
+
+/**
+ * Tests one address in a bitmap (one bit per address in a partition)
+ * 
+ * @param bitmap breakpoints or watchpoints
+ * @param ptr address, [0, PARTITION_WORDS)
+ * @return true or false
+ */
+bool testAddressBit(unsigned char const *bitmap, int ptr) {
+    return (bitmap[ptr >> 3] >> (ptr & 7)) & 1;
 } /* end */
 
 /**
- * Confirms timer interrupt based on number of instructions processed (timer count)
- * Doesn't let timer interrupt overlap with other system call
+ * Confirms address access based on pointer value and mode state
  * 
- * @param interrupt value entered by user (or defaults to 10,000)
- * @param timer is the current number of instructions executed
+ * @param ptr to memory access
  * @param kernelMode current mode of CPU
  * @return true or false
  */
-bool validateTimerInterrupt(int interrupt, int timer, bool kernelMode) {
-    if ((timer % interrupt == 0) && (kernelMode == false))
+bool validateAddressAccess(Word ptr, bool kernelMode) {
+    if ((kernelMode == false && (ptr >= 0 && ptr <= 999)) ||
+        (kernelMode == true && (ptr >= 1000 && ptr <= 1999)))
         return true;
     else
         return false;
 } /* end */
 
+/**
+ * Checks memory access for a range of addresses once, rather than per word
+ * User and system memory are each contiguous, so a range is valid when both ends are
+ * 
+ * @param first lowest address
+ * @param count words, at least 1
+ * @param kernelMode true if in kernel mode, false otherwise
+ * @return true or false
+ */
+bool validateAddressRange(Word first, Word count, bool kernelMode) {
+    return count <= PARTITION_WORDS && validateAddressAccess(first, kernelMode) && 
+           validateAddressAccess(first + count - 1, kernelMode);
+} /* end */
+
+/**
+ * Finds the first set bit in a range of a bitmap
+ * 
+ * @param bitmap breakpoints or watchpoints
+ * @param first lowest address, [0, PARTITION_WORDS)
+ * @param count addresses to check, range within the partition
+ * @return first set address, -1 if none
+ */
+int findAddressBit(unsigned char const *bitmap, int first, int count) {
+    for (int ptr = first; ptr < first + count; ptr++) {
+        if (testAddressBit(bitmap, ptr))
+            return ptr;
+    }
+    return -1;
+} /* end */
+
+/**
+ * Returns the block copy status value used throughout program (C = 67 on ascii table)
+ */
+int getCopyStatus() {
+    return 67;
+} /* end */
+
+/**
+ * Returns the exit status value used throughout program (c = 99 on ascii table)
+ */
+int getExitStatus() {
+    return 99;
+} /* end */
+
+/**
+ * Returns the fetch status value used throughout program (I = 73 on ascii table)
+ */
+int getFetchStatus() {
+    return 73;
+} /* end */
+
+/**
+ * Returns the block fill status value used throughout program (F = 70 on ascii table)
+ */
+int getFillStatus() {
+    return 70;
+} /* end */
+
 /**
  * Returns max pointer for system code, 1999
  */
@@ -813,6 +1528,27 @@ int getMaxUserProgramEntry() {
     return 999;
 } /* end */
 
+/**
+ * Returns the metrics status value used throughout program (M = 77 on ascii table)
+ */
+int getMetricsStatus() {
+    return 77;
+} /* end */
+
+/**
+ * Returns size of one process partition in memory, 2000 (user program and system code)
+ */
+int getPartitionSize() {
+    return getMaxSystemCodeEntry() + 1;
+} /* end */
+
+/**
+ * Returns the patch status value used throughout program (P = 80 on ascii table)
+ */
+int getPatchStatus() {
+    return 80;
+} /* end */
+
 /**
  * Returns the read status value used throughout program (r = 82 on ascii table)
  */
@@ -820,6 +1556,27 @@ int getReadStatus() {
     return 82;
 } /* end */
 
+/**
+ * Returns the reload status value used throughout program (L = 76 on ascii table)
+ */
+int getReloadStatus() {
+    return 76;
+} /* end */
+
+/**
+ * Returns the switch status value used throughout program (S = 83 on ascii table)
+ */
+int getSwitchStatus() {
+    return 83;
+} /* end */
+
+/**
+ * Returns the undo status value used throughout program (U = 85 on ascii table)
+ */
+int getUndoStatus() {
+    return 85;
+} /* end */
+
 /**
  * Returns the write status value used throughout program (w = 87 on ascii table)
  */
@@ -828,23 +1585,185 @@ int getWriteStatus() {
 } /* end */
 
 /**
- * Extracts integer values from line in file
+ * Returns how many words an instruction takes (the opcode, and the operand if it has one)
  * 
- * @param line from file
- * @return integer value
+ * @param IR opcode
+ * @return 1 or 2
  */
-int preprocessLine(char *line) {
-    char *c = line;
-    int i = 0;
-    while (c[i] != ' ' && c[i] != '\n') {
-        i += 1;
+int instructionWords(Word IR) {
+    switch (IR) {
+        case 1: case 2: case 3: case 4: case 5: case 7: case 9:
+        case 20: case 21: case 22: case 23: case 37: case 38:
+            return 2;
+        default:
+            return 1;
     }
-    c[i] = '\0';
-    return atoi(c);
 } /* end */
 
 /**
- * Returns random integer [1, 100]
+ * Returns the handler address for an interrupt source
+ * 
+ * Without a vector table, timer goes to 1000 and system call goes to 1500; fault and device have no handler.
+ * With a vector table, entry [source] holds the handler; 0 keeps the timer/system call default.
+ * 
+ * @param controller interrupt state
+ * @param bus memory access for the CPU
+ * @param source interrupt source
+ * @return handler address, 0 if there is none, -1 if the table holds one outside system memory
+ */
+int interruptVector(InterruptController *controller, MemoryBus *bus, int source) {
+    Word vector = 0;
+
+    if (controller->vectorTable != 0) {
+        vector = readMemory(bus, controller->vectorTable + source);
+    }
+
+    if (vector == 0 && source == IRQ_TIMER)
+        vector = 1000;
+    if (vector == 0 && source == IRQ_SYSCALL)
+        vector = 1500;
+
+    if (vector != 0 && !validateAddressAccess(vector, true))
+        return -1;
+
+    return vector;
+} /* end */
+
+/**
+ * Removes the highest priority deliverable interrupt from pending
+ * 
+ * @param controller interrupt state, pending & enabled must not be 0
+ * @return interrupt source
+ */
+int nextInterrupt(InterruptController *controller) {
+    int rank = __builtin_ctz(controller->pending & controller->enabled);
+    controller->pending &= ~(1u << rank);
+    return controller->source[rank];
+} /* end */
+
+/**
+ * Finds or adds the calling context node for frame under parent
+ * 
+ * @param profiler calling context tree
+ * @param parent node index
+ * @param frame callee address, or -(source + 1) for an interrupt
+ * @return node index
+ */
+int profileNode(Profiler *profiler, int parent, int frame) {
+    unsigned int bucket = ((unsigned int)parent * 2654435761u ^ (unsigned int)frame) & (profiler->bucketCount - 1);
+
+    for (int node = profiler->buckets[bucket]; node != -1; node = profiler->nodes[node].next) {
+        if (profiler->nodes[node].parent == parent && profiler->nodes[node].frame == frame)
+            return node;
+    }
+
+    if (profiler->nodeCount == profiler->nodeCapacity) {
+        profiler->nodeCapacity *= 2;
+        profiler->nodes = realloc(profiler->nodes, profiler->nodeCapacity * sizeof(ProfileNode));
+        if (profiler->nodes == NULL)
+            errorExit("realloc() failed");
+    }
+
+    int node = profiler->nodeCount;
+    profiler->nodeCount += 1;
+    profiler->nodes[node].parent = parent;
+    profiler->nodes[node].frame = frame;
+    profiler->nodes[node].samples = 0;
+    profiler->nodes[node].next = profiler->buckets[bucket];
+    profiler->buckets[bucket] = node;
+
+    // keep chains short; the tree only grows, so a rebuild is rare
+    if (profiler->nodeCount > profiler->bucketCount * 2)
+        rehashProfile(profiler);
+
+    return node;
+} /* end */
+
+/**
+ * Lists the Prometheus series for one run: runs by status, then the counters
+ * 
+ * @param status how the run ended
+ * @param metrics what the run did
+ * @param samples filled in, room for PROMETHEUS_SERIES
+ * @return number of samples
+ */
+int prometheusSamples(RunStatus status, Metrics const *metrics, PrometheusSample *samples) {
+    static char const *sourceNames[IRQ_SOURCES] = { "fault", "syscall", "timer", "device" };
+    int count = 0;
+
+    // every status is listed, so the file always has the whole family
+    for (int s = RUN_FINISHED; s <= RUN_VECTOR_FAULT; s++) {
+        samples[count] = (PrometheusSample){ "cpu_mem_sim_runs_total", "Runs by how they ended.", "", s == (int)status };
+        snprintf(samples[count++].labels, sizeof(samples[0].labels), "{status=\"%s\"}", runStatusName(s));
+    }
+
+    samples[count++] = (PrometheusSample){ "cpu_mem_sim_instructions_total", "Guest instructions by CPU mode.", 
+                                           "{mode=\"user\"}", metrics->instructions - metrics->kernelInstructions };
+    samples[count++] = (PrometheusSample){ "cpu_mem_sim_instructions_total", "Guest instructions by CPU mode.", 
+                                           "{mode=\"kernel\"}", metrics->kernelInstructions };
+    samples[count++] = (PrometheusSample){ "cpu_mem_sim_memory_reads_total", "Words the CPU read from memory.", 
+                                           "", metrics->memoryReads };
+    samples[count++] = (PrometheusSample){ "cpu_mem_sim_memory_writes_total", "Words the CPU wrote to memory.", 
+                                           "", metrics->memoryWrites };
+
+    for (int source = 0; source < IRQ_SOURCES; source++) {
+        samples[count] = (PrometheusSample){ "cpu_mem_sim_interrupts_total", "Interrupts taken by source.", 
+                                             "", metrics->interrupts[source] };
+        snprintf(samples[count++].labels, sizeof(samples[0].labels), "{source=\"%s\"}", sourceNames[source]);
+    }
+
+    samples[count++] = (PrometheusSample){ "cpu_mem_sim_syscalls_total", "System call instructions (29).", 
+                                           "", metrics->syscalls };
+    samples[count++] = (PrometheusSample){ "cpu_mem_sim_transport_calls_total", "Pipe read() and write() calls by process.", 
+                                           "{process=\"cpu\"}", metrics->cpuTransportCalls };
+    samples[count++] = (PrometheusSample){ "cpu_mem_sim_transport_calls_total", "Pipe read() and write() calls by process.", 
+                                           "{process=\"memory\"}", metrics->memoryTransportCalls };
+    samples[count++] = (PrometheusSample){ "cpu_mem_sim_run_seconds_total", "Wall clock time spent running programs.", 
+                                           "", metrics->elapsedNs / 1e9 };
+    return count;
+} /* end */
+
+/**
+ * Removes the next process from the ready queues
+ * 
+ * Round robin and priority take the head of the highest priority ready level.
+ * Lottery draws a level weighted by its processes' tickets (SCHEDULER_LEVELS - priority),
+ * then takes the head of that level. Cost depends on the number of levels, not processes.
+ * 
+ * @param scheduler holds the ready queues
+ * @return index of the process to run
+ */
+int pickNextProcess(Scheduler *scheduler) {
+    int level = 0;
+
+    if (scheduler->policy == LOTTERY) {
+        long totalTickets = 0;
+        for (int l = 0; l < SCHEDULER_LEVELS; l++) {
+            totalTickets += (long)scheduler->levelCount[l] * (SCHEDULER_LEVELS - l);
+        }
+
+        // xorshift, so the lottery doesn't disturb rand() used by case 8
+        long draw = nextRandom(&scheduler->lotterySeed) % totalTickets;
+        while (draw >= (long)scheduler->levelCount[level] * (SCHEDULER_LEVELS - level)) {
+            draw -= (long)scheduler->levelCount[level] * (SCHEDULER_LEVELS - level);
+            level += 1;
+        }
+    }
+    else {
+        level = __builtin_ctz(scheduler->readyLevels);
+    }
+
+    int pid = scheduler->head[level];
+    scheduler->head[level] = scheduler->table[pid].next;
+    scheduler->levelCount[level] -= 1;
+    if (scheduler->levelCount[level] == 0)
+        scheduler->readyLevels &= ~(1u << level);
+
+    return pid;
+} /* end */
+
+/**
+ * Returns random integer [1, 100] for the command line (instances and fuzz runs use a bus seed)
  * 
  * @param n is the PC value (helps with randomness)
  * @return random integer
@@ -856,16 +1775,139 @@ int randomInteger(int n) {
     return rand() % max + 1;
 } /* end */
 
+/**
+ * Removes an optional :priority suffix from a file name
+ * 
+ * @param fileName from command line, truncated at the suffix
+ * @return priority [0, SCHEDULER_LEVELS - 1], 0 is highest (default 0)
+ */
+int splitPriority(char *fileName) {
+    char *suffix = strrchr(fileName, ':');
+    if (suffix == NULL || !isNumber(suffix + 1) || access(fileName, F_OK) == 0)
+        return 0;
+
+    int priority = atoi(suffix + 1);
+    if (priority >= SCHEDULER_LEVELS)
+        errorExit("priority out of range");
+
+    *suffix = '\0';
+    return priority;
+} /* end */
+
+/**
+ * Returns random integer [1, 100], the same one again when a replay draws it a second time
+ * 
+ * @param history holds the random log
+ * @param n is the PC value (passed on to randomInteger)
+ * @return random integer
+ */
+Word historyRandom(History *history, int n) {
+    Word *slot = &history->randoms[history->randomCount % HISTORY_RANDOMS];
+    if (history->randomCount == history->randomEnd) {
+        *slot = randomInteger(n);
+        history->randomEnd += 1;
+    }
+    history->randomCount += 1;
+    return *slot;
+} /* end */
+
+/**
+ * Extracts integer values from line in file
+ * 
+ * @param line from file
+ * @return integer value
+ */
+Word preprocessLine(char *line) {
+    char *c = line;
+    int i = 0;
+    while (c[i] != ' ' && c[i] != '\n' && c[i] != '\0') {
+        i += 1;
+    }
+    c[i] = '\0';
+    return (Word)strtoll(c, NULL, 10);
+} /* end */
+
+/**
+ * Predicts where the instruction after this one starts, so its fetch can be sent now
+ * Jumps and calls read their target from the line already fetched with the opcode, and the
+ * conditional jumps test AC, so only returns, system calls, interrupts, and writes to the 
+ * line itself mispredict
+ * 
+ * @param bus memory access for the CPU
+ * @param IR opcode, read from PC
+ * @param PC address of the opcode
+ * @param AC accumulator before the instruction runs
+ * @return address of the next instruction, -1 if it can't be known yet
+ */
+Word predictNextPC(MemoryBus *bus, Word IR, Word PC, Word AC) {
+    FetchLine *line = &bus->fetchLines[bus->fetchCurrent];
+    bool taken = IR == 20 || IR == 23 || (IR == 21 && AC == 0) || (IR == 22 && AC != 0);
+
+    if (IR == 24 || IR == 29 || IR == 30 || IR == 50)
+        return -1;
+
+    if (taken)
+        return (line->valid && line->address == PC) ? line->words[1] : -1;
+
+    return WORD_ADD(PC, instructionWords(IR));
+} /* end */
+
+/**
+ * Reads value at address through the memory process (or the in-process image)
+ * Records a hit if the address is watched for reads
+ * 
+ * @param bus memory access for the CPU
+ * @param ptr address, already validated
+ * @return value that is read
+ */
+Word readMemory(MemoryBus *bus, int ptr) {
+    if (bus->debugger != NULL && testAddressBit(bus->debugger->readWatchpoints, ptr)) {
+        bus->debugger->watchHit = ptr;
+        bus->debugger->watchWrite = false;
+    }
+
+    bus->reads += 1;
+    if (bus->image != NULL)
+        return bus->partition[ptr];
+
+    // a fetched word; the line that starts at ptr wins, since it holds an instruction's operand too
+    FetchLine *hit = NULL;
+    for (int i = 0; i < FETCH_LINES; i++) {
+        FetchLine *line = &bus->fetchLines[i];
+        if ((line->valid || line->pending) && (UWord)(ptr - line->address) < 2 && 
+            (hit == NULL || line->address == ptr)) {
+            hit = line;
+            bus->fetchCurrent = i;
+        }
+    }
+    if (hit != NULL) {
+        if (hit->pending)
+            collectFetch(bus);
+        return hit->words[ptr - hit->address];
+    }
+
+    // status and ptr writes, value read; replies come back in order, so a pending fetch is read first
+    bus->transportCalls += 3;
+    pipeReadStatusAndPTR(bus->cpuToMemory, ptr, getReadStatus());
+    collectFetch(bus);
+    return readFromMemory(bus->memoryToCPU);
+} /* end */
+
 /**
  * Reads value from CPU process
  * 
  * @param cpuToMemory pipe
  * @return value that is read
  */
-int readFromCPU(int *cpuToMemory) {
-    int value;
-    if (read(cpuToMemory[0], &value, sizeof(value)) == -1)
+Word readFromCPU(int *cpuToMemory) {
+    Word value;
+    ssize_t count = read(cpuToMemory[0], &value, sizeof(value));
+    if (count == -1)
         errorExit("cpu to memory read() failed");
+
+    // end of file: the cpu exited (on an error) without the exit signal, so memory exits too
+    if (count == 0)
+        exit(0);
     return value;
 } /* end */
 
@@ -875,127 +1917,1688 @@ int readFromCPU(int *cpuToMemory) {
  * @param memoryToCPU pipe
  * @return value that is read
  */
-int readFromMemory(int *memoryToCPU) {
-    int value;
+Word readFromMemory(int *memoryToCPU) {
+    Word value;
     if (read(memoryToCPU[0], &value, sizeof(value)) == -1)
         errorExit("memory to cpu read() failed");
     return value;
 } /* end */
 
 /**
- * Writes PC and SP to memory (for entering kernel mode)
+ * Xorshift, for draws that must not disturb rand() (or depend on the clock, as case 8 does)
  * 
- * @param cpuToMemory pipe
- * @param SP stack pointer value
- * @param PC program counter value
- * @param tempSP max system code value
- * @return 1000, which is PC value
+ * @param seed state, never 0
+ * @return next value
  */
-int timerInterrupt(int *cpuToMemory, int SP, int PC, int tempSP) {
-    int writeStatus = getWriteStatus();
-    pipeAddressToStack(cpuToMemory, writeStatus, tempSP, PC);
-
-    tempSP -= 1;
-    pipeAddressToStack(cpuToMemory, writeStatus, tempSP, SP);
-    return 1000;
+unsigned int nextRandom(unsigned int *seed) {
+    unsigned int value = *seed;
+    value ^= value << 13;
+    value ^= value >> 17;
+    value ^= value << 5;
+    *seed = value;
+    return value;
 } /* end */
 
 /**
- * Close pipe ends
+ * Converts a mask of source bits (1 << IRQ_*) to priority rank bits
  * 
- * @param cpuToMemory pipe
- * @param memoryToCPU pipe
- * @param cpuInt used to close a cpuToMemory side
- * @param memoryInt used to close a memoryToCPU side
- */    
-void closePipes(int *cpuToMemory, int *memoryToCPU, int cpuInt, int memoryInt) {
-    close(cpuToMemory[cpuInt]);
-    close(memoryToCPU[memoryInt]);
+ * @param controller interrupt state
+ * @param sourceBits mask indexed by source
+ * @return mask indexed by rank
+ */
+unsigned int sourceBitsToRanks(InterruptController *controller, unsigned int sourceBits) {
+    unsigned int rankBits = 0;
+    for (int source = 0; source < IRQ_SOURCES; source++) {
+        if (sourceBits & (1u << source))
+            rankBits |= 1u << controller->rank[source];
+    }
+    return rankBits;
 } /* end */
 
 /**
- * Prints error and exits program
+ * Returns nanoseconds between two monotonic clock readings
+ * 
+ * @param start earlier reading
+ * @param end later reading
+ * @return elapsed nanoseconds
  */
-void errorExit(char *s) {
-    fprintf(stderr, "\nERROR: %s - exiting!\n\n", s);
-    exit(1);
+long elapsedNanoseconds(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
 } /* end */
 
 /**
- * Write read status and ptr to memory
+ * Finds the earliest instruction count going back can reach
  * 
- * @param cpuToMemory pipe
- * @param ptr value at address that will be read
- * @param readStatus inform memory of status
+ * @param history snapshots and logs
+ * @param bus memory access for the CPU
+ * @return instruction count of the oldest snapshot that can be restored, -1 if none can
  */
-void pipeReadStatusAndPTR(int *cpuToMemory, int ptr, int readStatus) {
-    if (write(cpuToMemory[1], &readStatus, sizeof(readStatus)) == -1)
-        errorExit("write() failed");
-    
-    if (write(cpuToMemory[1], &ptr, sizeof(ptr)) == -1)
-        errorExit("write() failed");
+long historyStart(History *history, MemoryBus *bus) {
+    // a newer snapshot needs less of the logs, so the first valid one is the oldest
+    for (int i = 0; i < history->count; i++) {
+        HistorySnapshot const *snapshot = &history->snapshots[(history->first + i) % HISTORY_SNAPSHOTS];
+        if (isHistoryValid(history, bus, snapshot))
+            return snapshot->registers.executed;
+    }
+    return -1;
 } /* end */
 
 /**
- * Pipe write status, address, value to memory process
+ * Finds the snapshot to replay from, to get back to an instruction count
  * 
- * @param cpuToMemory pipe
- * @param writeStatus inform memory of status
- * @param ptr address to write to
- * @param value value to write to address (ptr)
+ * @param history snapshots and logs
+ * @param bus memory access for the CPU
+ * @param executed instruction count to go back to
+ * @return newest snapshot at or before executed, NULL if it can't be restored
  */
-void pipeAddressToStack(int *cpuToMemory, int writeStatus, int ptr, int value) {
-    if (write(cpuToMemory[1], &writeStatus, sizeof(writeStatus)) == -1)
-        errorExit("status, cpu to memory write() failed");
-
-    if (write(cpuToMemory[1], &ptr, sizeof(ptr)) == -1)
-        errorExit("ptr, cpu to memory write() failed");
-
-    if (write(cpuToMemory[1], &value, sizeof(value)) == -1)
-        errorExit("value, cpu to memory write() failed");
+HistorySnapshot *findHistorySnapshot(History *history, MemoryBus *bus, long executed) {
+    for (int i = history->count - 1; i >= 0; i--) {
+        HistorySnapshot *snapshot = &history->snapshots[(history->first + i) % HISTORY_SNAPSHOTS];
+        if (snapshot->registers.executed <= executed)
+            return isHistoryValid(history, bus, snapshot) ? snapshot : NULL;
+    }
+    return NULL;
 } /* end */
 
 /**
- * Read file (integer values) into memory array
+ * Takes the next snapshot, dropping the oldest when the ring is full
+ * Copies the scheduler, process table, and interrupt controller, and where the logs are;
+ * the caller adds the registers and the rest of its locals
  * 
- * @param file is file name
- * @param memory is memory array
+ * @param history snapshots and logs
+ * @param scheduler holds the process table and ready queues
+ * @param controller interrupt state
+ * @param bus memory counters so far
+ * @return the snapshot
  */
-void processFileInput(FILE *file, int *memory) {
-    char line[256];
-    int i = 0;
-
-    /*
-        If line begins with a period, change loader address (index value).
-        Ignore any line that starts with a newline character or space
-        Keep only integer values on line and store into memory array.
-    */
-    while (fgets(line, sizeof(line), file)) {
-        if (line[0] == '.') {
-            char *changeLoadAddress = line + 1;
-            i = preprocessLine(changeLoadAddress);
-        }
-        else if (line[0] != '\n' && line[0] != ' ') {
-            memory[i] = preprocessLine(line);
-            i += 1;
-        }
+HistorySnapshot *saveHistory(History *history, Scheduler const *scheduler, InterruptController const *controller, 
+                             MemoryBus const *bus) {
+    if (history->count == HISTORY_SNAPSHOTS) {
+        history->first = (history->first + 1) % HISTORY_SNAPSHOTS;
+        history->count -= 1;
     }
+    HistorySnapshot *snapshot = &history->snapshots[(history->first + history->count) % HISTORY_SNAPSHOTS];
+    history->count += 1;
+    history->nextSnapshot += history->interval;
+
+    // the snapshot keeps its own table, allocated by initHistory
+    ProcessControlBlock *table = snapshot->table;
+    memcpy(table, scheduler->table, scheduler->processCount * sizeof(ProcessControlBlock));
+    snapshot->scheduler = *scheduler;
+    snapshot->controller = *controller;
+    snapshot->table = table;
+    snapshot->reads = bus->reads;
+    snapshot->writes = bus->writes;
+    snapshot->transportCalls = bus->transportCalls;
+    snapshot->randoms = history->randomCount;
+    return snapshot;
 } /* end */
 
 /**
- * Prints value in AC (either char or int)
+ * Watchdog: checks a run against its budgets and picks the instruction count of the next check
+ * The wall clock is only read here, so a check costs one clock_gettime() every WATCHDOG_INSTRUCTIONS
  * 
- * @param port determines printing of int (1) or char (2)
- * @param AC value in AC 
+ * @param limits budgets and the time the run started
+ * @param bus memory reads and writes so far
+ * @param executed instructions so far
+ * @param nextCheck set to the instruction count of the next check
+ * @return RUN_FINISHED to keep running, otherwise the budget that ran out
  */
-void showAC(int port, int AC) {
-    if (port == 1) {
-        printf("%d", AC);
+RunStatus checkRunLimits(RunLimits *limits, MemoryBus *bus, long executed, long *nextCheck) {
+    if (limits->instructions > 0 && executed >= limits->instructions)
+        return RUN_INSTRUCTION_LIMIT;
+
+    if (limits->memoryAccesses > 0 && bus->reads + bus->writes >= limits->memoryAccesses)
+        return RUN_ACCESS_LIMIT;
+
+    if (limits->wallNs > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (elapsedNanoseconds(&limits->started, &now) >= limits->wallNs)
+            return RUN_TIME_LIMIT;
     }
-    if (port == 2) {
-        char charAC = AC;
-        printf("%c", charAC);
+
+    *nextCheck = executed + WATCHDOG_INSTRUCTIONS;
+    if (limits->instructions > 0 && *nextCheck > limits->instructions)
+        *nextCheck = limits->instructions;
+
+    // checks come closer as the access budget runs low, so it is never crossed between two of them 
+    // by more than one instruction (block operations ask for a check right after them)
+    if (limits->memoryAccesses > 0) {
+        long room = (limits->memoryAccesses - bus->reads - bus->writes) / WATCHDOG_ACCESSES;
+        if (*nextCheck > executed + room + 1)
+            *nextCheck = executed + room + 1;
+    }
+    return RUN_FINISHED;
+} /* end */
+
+/**
+ * Saves SP and PC on the system stack and marks the interrupt in service
+ * 
+ * The first interrupt saves them at the end of system memory (1999, 1998), as before.
+ * A nested interrupt saves them below the current system SP.
+ * 
+ * @param controller interrupt state
+ * @param bus memory access for the CPU
+ * @param source interrupt being taken
+ * @param vector handler address
+ * @param SP stack pointer, set to the saved SP's address
+ * @param PC program counter value to return to, set to vector
+ * @return RUN_FINISHED, or why the interrupt can't be taken (nothing is changed then)
+ */
+RunStatus enterInterrupt(InterruptController *controller, MemoryBus *bus, int source, int vector, Word *SP, Word *PC) {
+    Word tempSP = (controller->depth == 0) ? getMaxSystemCodeEntry() : WORD_SUB(*SP, 1);
+
+    if (controller->depth == IRQ_MAX_NESTING)
+        return RUN_NESTING_LIMIT;
+
+    if (!validateAddressAccess(WORD_SUB(tempSP, 1), true))
+        return RUN_FRAME_FAULT;
+
+    writeMemory(bus, tempSP, *PC);
+
+    tempSP -= 1;
+    writeMemory(bus, tempSP, *SP);
+    *SP = tempSP;
+
+    controller->stack[controller->depth] = controller->rank[source];
+    controller->depth += 1;
+    updateInterruptEnable(controller);
+    *PC = vector;
+    return RUN_FINISHED;
+} /* end */
+
+/**
+ * Maps a scheduler name from the command line to its policy
+ * 
+ * @param name is rr, priority, or lottery
+ * @return scheduler policy
+ */
+SchedulerPolicy parseSchedulerPolicy(char const *name) {
+    if (strcmp(name, "rr") == 0)
+        return ROUND_ROBIN;
+    if (strcmp(name, "priority") == 0)
+        return PRIORITY;
+    if (strcmp(name, "lottery") == 0)
+        return LOTTERY;
+
+    errorExit("unknown scheduler (rr, priority, lottery)");
+    return ROUND_ROBIN;
+} /* end */
+
+/**
+ * Formats one counter for the host counter report
+ * Task clock and context switches fall back to getrusage() figures (marked *)
+ * 
+ * @param counters values for one host process
+ * @param counter index into counters->value
+ * @param cell buffer, at least 32 bytes
+ * @return cell
+ */
+char *formatPerfCounter(PerfCounters const *counters, int counter, char *cell) {
+    bool supported = (counters->supported & (1u << counter)) != 0;
+
+    if (counter == PERF_TASK_CLOCK)
+        sprintf(cell, supported ? "%.3f" : "%.3f*", 
+            (supported ? (double)counters->value[counter] : counters->cpuTimeNs) / 1e6);
+    else if (supported)
+        sprintf(cell, "%llu", counters->value[counter]);
+    else if (counter == PERF_CONTEXT_SWITCHES)
+        sprintf(cell, "%ld*", counters->contextSwitches);
+    else
+        sprintf(cell, "n/a");
+    return cell;
+} /* end */
+
+/**
+ * Loads a program: a binary image when it starts with this build's magic, text otherwise
+ * 
+ * @param fp program file (or buffer) at its start
+ * @param memory partition to load into
+ * @return NULL, or what is wrong with the program
+ */
+char *loadProgram(FILE *fp, Word *memory) {
+    uint32_t magic = 0;
+    if (fread(&magic, sizeof(magic), 1, fp) == 1 && magic == IMAGE_MAGIC)
+        return processImageInput(fp, memory);
+    if (magic == IMAGE_MAGIC_32 || magic == IMAGE_MAGIC_64)
+        return "image word width does not match this build";
+
+    rewind(fp);
+    return processFileInput(fp, memory);
+} /* end */
+
+/**
+ * Returns the name of a profile frame for collapsed stack output
+ * 
+ * @param frame callee address, or -(source + 1) for an interrupt
+ * @param name buffer, at least 16 bytes
+ * @return name
+ */
+char *profileFrameName(int frame, char *name) {
+    static char const *sourceNames[IRQ_SOURCES] = { "fault", "syscall", "timer", "device" };
+
+    if (frame >= 0)
+        sprintf(name, "call@%d", frame);
+    else
+        sprintf(name, "%s", sourceNames[-frame - 1]);
+    return name;
+} /* end */
+
+/**
+ * Names a program's root frame in collapsed stacks: its file name without the directory, with 
+ * ';' and whitespace (which separate frames and the count) replaced by '_'
+ * 
+ * @param fileName program file as given on the command line
+ * @param name buffer for the name
+ * @param size bytes in name (a longer name is cut short)
+ * @return name
+ */
+char *profileRootName(char const *fileName, char *name, size_t size) {
+    char const *slash = strrchr(fileName, '/');
+    snprintf(name, size, "%s", (slash != NULL) ? slash + 1 : fileName);
+
+    for (char *c = name; *c != '\0'; c++) {
+        if (*c == ';' || isspace((unsigned char)*c))
+            *c = '_';
+    }
+    return name;
+} /* end */
+
+/**
+ * Describes how a run ended, in the words the simulator has always exited with
+ * 
+ * @param status from cpuProcess
+ * @return message
+ */
+char *runStatusMessage(RunStatus status) {
+    switch (status) {
+        case RUN_FINISHED:
+            return "finished";
+        case RUN_INSTRUCTION_LIMIT:
+            return "instruction limit reached";
+        case RUN_TIME_LIMIT:
+            return "time limit reached";
+        case RUN_ACCESS_LIMIT:
+            return "memory access limit reached";
+        case RUN_INVALID_OPCODE:
+            return "No case!";
+        case RUN_MEMORY_FAULT:
+            return "Memory violation: accessing address in wrong mode";
+        case RUN_DIVIDE_FAULT:
+            return "Division by zero";
+        case RUN_NESTING_LIMIT:
+            return "interrupts nested too deep";
+        case RUN_FRAME_FAULT:
+            return "Memory violation: interrupt frame outside system memory";
+        case RUN_VECTOR_FAULT:
+            return "interrupt vector outside system memory";
+    }
+    return "unknown run status";
+} /* end */
+
+/**
+ * Names how a run ended, for metrics
+ * 
+ * @param status from cpuProcess
+ * @return name in snake case
+ */
+char *runStatusName(RunStatus status) {
+    static char *statusNames[] = { "finished", "instruction_limit", "time_limit", "access_limit", "invalid_opcode", 
+                                   "memory_fault", "divide_fault", "nesting_limit", "frame_fault", "vector_fault" };
+    if (status < RUN_FINISHED || status > RUN_VECTOR_FAULT)
+        return "unknown";
+    return statusNames[status];
+} /* end */
+
+/**
+ * Close pipe ends
+ * 
+ * @param cpuToMemory pipe
+ * @param memoryToCPU pipe
+ * @param cpuInt used to close a cpuToMemory side
+ * @param memoryInt used to close a memoryToCPU side
+ */    
+void closePipes(int *cpuToMemory, int *memoryToCPU, int cpuInt, int memoryInt) {
+    close(cpuToMemory[cpuInt]);
+    close(memoryToCPU[memoryInt]);
+} /* end */
+
+/**
+ * Reads the reply to the pending fetch, if there is one, into its line
+ * 
+ * @param bus memory access for the CPU
+ */
+void collectFetch(MemoryBus *bus) {
+    for (int i = 0; i < FETCH_LINES; i++) {
+        FetchLine *line = &bus->fetchLines[i];
+        if (line->pending) {
+            bus->transportCalls += 1;
+            if (read(bus->memoryToCPU[0], line->words, sizeof(line->words)) != sizeof(line->words))
+                errorExit("memory to cpu read() failed");
+            line->pending = false;
+            line->valid = true;
+        }
+    }
+} /* end */
+
+/**
+ * Copies a block of words inside the memory process, in one request (or in the image)
+ * Records a hit if any address in the ranges is watched
+ * 
+ * @param bus memory access for the CPU
+ * @param from first source address, range already validated
+ * @param to first destination address, range already validated
+ * @param count words to copy
+ */
+void copyMemory(MemoryBus *bus, int from, int to, int count) {
+    bus->reads += count;
+    bus->writes += count;
+    if (bus->image != NULL) {
+        memmove(bus->partition + to, bus->partition + from, count * sizeof(Word));
+        if (bus->dirtyPages != NULL && count > 0)
+            markDirtyPages(bus, to, count);
+    }
+    else {
+        bus->transportCalls += 1;
+        pipeBlockRequest(bus->cpuToMemory, getCopyStatus(), from, to, count);
+        dropFetches(bus, to, count);
+    }
+    watchMemoryRange(bus, from, count, to, count);
+} /* end */
+
+/**
+ * Drops fetched lines that hold any address in a range, after a write to it or a partition switch
+ * A pending line is collected first, since its reply is still on the way
+ * 
+ * @param bus memory access for the CPU
+ * @param first lowest address written
+ * @param count words written
+ */
+void dropFetches(MemoryBus *bus, int first, int count) {
+    for (int i = 0; i < FETCH_LINES; i++) {
+        FetchLine *line = &bus->fetchLines[i];
+        if ((line->valid || line->pending) && line->address + 1 >= first && line->address < first + count) {
+            if (line->pending)
+                collectFetch(bus);
+            line->valid = false;
+        }
+    }
+} /* end */
+
+/**
+ * Adds a process to the tail of its ready level
+ * Round robin keeps every process on level 0
+ * 
+ * @param scheduler holds the ready queues
+ * @param pid index of the process in the process table
+ */
+void enqueueProcess(Scheduler *scheduler, int pid) {
+    int level = (scheduler->policy == ROUND_ROBIN) ? 0 : scheduler->table[pid].priority;
+
+    scheduler->table[pid].next = -1;
+    if (scheduler->levelCount[level] == 0)
+        scheduler->head[level] = pid;
+    else
+        scheduler->table[scheduler->tail[level]].next = pid;
+
+    scheduler->tail[level] = pid;
+    scheduler->levelCount[level] += 1;
+    scheduler->readyLevels |= 1u << level;
+} /* end */
+
+/**
+ * Returns from the innermost interrupt and reloads the guest mask
+ * 
+ * @param controller interrupt state
+ * @param bus memory access for the CPU
+ */
+void exitInterrupt(InterruptController *controller, MemoryBus *bus) {
+    if (controller->depth > 0)
+        controller->depth -= 1;
+
+    loadInterruptMask(controller, bus);
+} /* end */
+
+/**
+ * Writes one run's metrics wherever they were asked for
+ * 
+ * @param metricsExport JSON lines file and Prometheus file (either may be NULL)
+ * @param scheduler holds the process table (file names go in the JSON line)
+ * @param status how the run ended
+ * @param metrics CPU and memory counts, merged
+ */
+void exportMetrics(MetricsExport const *metricsExport, Scheduler *scheduler, RunStatus status, Metrics const *metrics) {
+    if (metricsExport->jsonFile != NULL)
+        writeJsonMetrics(metricsExport->jsonFile, scheduler, status, metrics);
+
+    if (metricsExport->prometheusFile != NULL)
+        writePrometheusMetrics(metricsExport->prometheusFile, status, metrics);
+} /* end */
+
+/**
+ * Fills a block of words inside the memory process, in one request (or in the image)
+ * Records a hit if any address in the range is watched for writes
+ * 
+ * @param bus memory access for the CPU
+ * @param to first address, range already validated
+ * @param count words to fill
+ * @param value value to store
+ */
+void fillMemory(MemoryBus *bus, int to, int count, Word value) {
+    bus->writes += count;
+    if (bus->image != NULL) {
+        for (int i = 0; i < count; i++)
+            bus->partition[to + i] = value;
+        if (bus->dirtyPages != NULL && count > 0)
+            markDirtyPages(bus, to, count);
+    }
+    else {
+        bus->transportCalls += 1;
+        pipeBlockRequest(bus->cpuToMemory, getFillStatus(), to, count, value);
+        dropFetches(bus, to, count);
+    }
+    watchMemoryRange(bus, 0, 0, to, count);
+} /* end */
+
+/**
+ * Stops the CPU and reads debugger commands until one resumes it
+ * Closing the command channel detaches the debugger and lets the program run to the end
+ * With a history, back and goto can set an earlier instruction count for the CPU to go back to
+ * 
+ * @param debugger breakpoints, watchpoints, and command channel
+ * @param bus memory access for the CPU (examine reads bypass watchpoints)
+ * @param pid current process
+ * @param registers current registers (IR is the last instruction)
+ */
+void debugPrompt(Debugger *debugger, MemoryBus *bus, int pid, Registers *registers) {
+    char line[256];
+    char command[16];
+    int first, second;
+
+    fflush(stdout);
+    debugger->replaying = false;
+
+    if (debugger->watchHit >= 0)
+        fprintf(debugger->out, "\nwatchpoint: %s %d\n", debugger->watchWrite ? "write" : "read", debugger->watchHit);
+    else if ((UWord)registers->PC < PARTITION_WORDS && testAddressBit(debugger->breakpoints, registers->PC))
+        fprintf(debugger->out, "\nbreakpoint: " WORD_FORMAT "\n", registers->PC);
+    debugger->watchHit = -1;
+
+    fprintf(debugger->out, "stopped: pid %d PC " WORD_FORMAT " (%s) after %ld instructions\n", pid, registers->PC, 
+            registers->kernelMode ? "kernel" : "user", registers->executed);
+
+    while (true) {
+        fprintf(debugger->out, "(sim) ");
+        fflush(debugger->out);
+
+        // closed channel: clear everything and run to the end
+        if (fgets(line, sizeof(line), debugger->in) == NULL) {
+            memset(debugger->breakpoints, 0, sizeof(debugger->breakpoints));
+            memset(debugger->readWatchpoints, 0, sizeof(debugger->readWatchpoints));
+            memset(debugger->writeWatchpoints, 0, sizeof(debugger->writeWatchpoints));
+            debugger->stepsLeft = 0;
+            return;
+        }
+
+        int count = sscanf(line, "%15s %d %d", command, &first, &second);
+        if (count < 1)
+            continue;
+        if (count < 3)
+            second = first;
+
+        // address commands take one address or an inclusive range
+        bool hasRange = count >= 2 && first >= 0 && second >= first && second < PARTITION_WORDS;
+
+        if (strcmp(command, "c") == 0 || strcmp(command, "continue") == 0) {
+            return;
+        }
+        else if (strcmp(command, "s") == 0 || strcmp(command, "step") == 0) {
+            // counted down before every following instruction
+            debugger->stepsLeft = (count >= 2 && first > 0) ? first : 1;
+            return;
+        }
+        else if (strcmp(command, "r") == 0 || strcmp(command, "regs") == 0) {
+            fprintf(debugger->out, "PC " WORD_FORMAT " SP " WORD_FORMAT " IR " WORD_FORMAT " AC " WORD_FORMAT 
+                " X " WORD_FORMAT " Y " WORD_FORMAT " timer %ld mode %s\n",
+                registers->PC, registers->SP, registers->IR, registers->AC, registers->X, registers->Y,
+                registers->timer, registers->kernelMode ? "kernel" : "user");
+        }
+        else if (strcmp(command, "x") == 0) {
+            // x address [count]
+            int last = (count >= 3) ? first + second - 1 : first;
+            if (count < 2 || first < 0 || last < first || last >= PARTITION_WORDS) {
+                fprintf(debugger->out, "x address [count]\n");
+                continue;
+            }
+
+            // a bus without the debugger, so examining doesn't trip read watchpoints
+            // (and with no fetch pending, since the copy can't tell the bus it read the reply)
+            collectFetch(bus);
+            MemoryBus examine = *bus;
+            examine.debugger = NULL;
+            for (int ptr = first; ptr <= last; ptr++) {
+                fprintf(debugger->out, "%d: " WORD_FORMAT "\n", ptr, readMemory(&examine, ptr));
+            }
+        }
+        else if (strcmp(command, "back") == 0 || strcmp(command, "goto") == 0) {
+            // back [n] goes n instructions back, goto count to where count instructions have run
+            long steps = 1;
+            bool hasCount = sscanf(line, "%*s %ld", &steps) == 1;
+            long target = (command[0] == 'b') ? registers->executed - steps : steps;
+            if ((command[0] == 'g') ? (!hasCount || steps < 0) : steps <= 0) {
+                fprintf(debugger->out, "back [n] | goto count\n");
+                continue;
+            }
+            if (debugger->history == NULL) {
+                fprintf(debugger->out, "no history, run with -R interval\n");
+                continue;
+            }
+
+            // ahead is just steps (at an error there is no ahead, and the run ends)
+            if (target >= registers->executed) {
+                if (target == registers->executed)
+                    continue;
+                debugger->stepsLeft = (target - registers->executed < INT_MAX) ? target - registers->executed : INT_MAX;
+                return;
+            }
+
+            long start = historyStart(debugger->history, bus);
+            if (start < 0 || target < start) {
+                fprintf(debugger->out, "history starts at instruction %ld\n", start < 0 ? registers->executed : start);
+                continue;
+            }
+            debugger->travelTo = target;
+            return;
+        }
+        else if (strcmp(command, "q") == 0 || strcmp(command, "quit") == 0) {
+            // quitting on purpose isn't an error: memory gets the exit signal, and the status is 0
+            fflush(stdout);
+            if (bus->image == NULL)
+                pipeStatus(bus->cpuToMemory, getExitStatus());
+            exit(0);
+        }
+        else if (strcmp(command, "b") == 0 || strcmp(command, "break") == 0 ||
+                 strcmp(command, "d") == 0 || strcmp(command, "delete") == 0 ||
+                 strcmp(command, "watch") == 0 || strcmp(command, "rwatch") == 0 ||
+                 strcmp(command, "unwatch") == 0) {
+            if (!hasRange) {
+                fprintf(debugger->out, "%s address [end], address in [0, %d)\n", command, PARTITION_WORDS);
+                continue;
+            }
+
+            if (command[0] == 'b')
+                setAddressBits(debugger->breakpoints, first, second, true);
+            if (command[0] == 'd')
+                setAddressBits(debugger->breakpoints, first, second, false);
+            if (strcmp(command, "watch") == 0)
+                setAddressBits(debugger->writeWatchpoints, first, second, true);
+            if (strcmp(command, "rwatch") == 0)
+                setAddressBits(debugger->readWatchpoints, first, second, true);
+            if (strcmp(command, "unwatch") == 0) {
+                setAddressBits(debugger->writeWatchpoints, first, second, false);
+                setAddressBits(debugger->readWatchpoints, first, second, false);
+            }
+        }
+        else {
+            fprintf(debugger->out,
+                "commands: continue | step [n] | regs | x address [count] | quit\n"
+                "          break | delete | watch | rwatch | unwatch  address [end]\n"
+                "          back [n] | goto count  (with -R)\n");
+        }
+    }
+} /* end */
+
+/**
+ * Releases history memory
+ * 
+ * @param history to free
+ */
+void freeHistory(History *history) {
+    free(history->snapshots[0].table);
+    free(history->randoms);
+} /* end */
+
+/**
+ * Releases profiler memory
+ * 
+ * @param profiler to free
+ */
+void freeProfiler(Profiler *profiler) {
+    for (int pid = 0; pid < profiler->processCount; pid++) {
+        free(profiler->stacks[pid].frames);
+    }
+    free(profiler->stacks);
+    free(profiler->nodes);
+    free(profiler->buckets);
+} /* end */
+
+/**
+ * Prints error and exits program
+ */
+void errorExit(char *s) {
+    fprintf(stderr, "\nERROR: %s - exiting!\n\n", s);
+    exit(1);
+} /* end */
+
+/**
+ * Sets up the debugger command channel; the CPU stops before its first instruction
+ * 
+ * @param debugger to initialize
+ * @param socketPath Unix socket to accept one client on, NULL for stdin (replies on stderr)
+ */
+void initDebugger(Debugger *debugger, char const *socketPath) {
+    memset(debugger, 0, sizeof(*debugger));
+    debugger->stepsLeft = 1;
+    debugger->watchHit = -1;
+    debugger->travelTo = -1;
+    debugger->in = stdin;
+    debugger->out = stderr;
+
+    if (socketPath == NULL)
+        return;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+        errorExit("debugger socket path too long");
+    strcpy(address.sun_path, socketPath);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == -1)
+        errorExit("socket() failed");
+
+    unlink(socketPath);
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listener, 1) == -1)
+        errorExit("debugger socket bind() failed");
+
+    fprintf(stderr, "debugger waiting on %s\n", socketPath);
+    int client = accept(listener, NULL, NULL);
+    if (client == -1)
+        errorExit("accept() failed");
+
+    close(listener);
+    unlink(socketPath);
+
+    debugger->in = fdopen(client, "r");
+    debugger->out = fdopen(dup(client), "w");
+    if (debugger->in == NULL || debugger->out == NULL)
+        errorExit("fdopen() failed");
+} /* end */
+
+/**
+ * Sets up reverse execution; the first snapshot is taken before the first instruction
+ * 
+ * @param history to initialize
+ * @param interval instructions between snapshots
+ * @param undoWords writes the memory process keeps old values for
+ * @param processCount entries in the process table
+ */
+void initHistory(History *history, int interval, long undoWords, int processCount) {
+    memset(history, 0, sizeof(*history));
+    history->interval = interval;
+    history->undoWords = undoWords;
+
+    // one block holds every snapshot's copy of the process table
+    ProcessControlBlock *tables = calloc((size_t)HISTORY_SNAPSHOTS * processCount, sizeof(ProcessControlBlock));
+    history->randoms = malloc(HISTORY_RANDOMS * sizeof(Word));
+    if (tables == NULL || history->randoms == NULL)
+        errorExit("malloc() failed");
+
+    for (int i = 0; i < HISTORY_SNAPSHOTS; i++)
+        history->snapshots[i].table = tables + (size_t)i * processCount;
+} /* end */
+
+/**
+ * Sets interrupt priorities, host mask, and vector table address
+ * 
+ * Fault and system call are synchronous: they ignore masks and nest inside any handler.
+ * Timer and device are taken only if unmasked and higher priority than every handler in service.
+ * The timer is edge triggered (a tick that can't be taken is lost), the others stay pending.
+ * 
+ * @param controller to initialize
+ * @param priority rank for each source, 0 is highest
+ * @param hostMask source bits masked from the command line
+ * @param vectorTable address of vector table in system memory, 0 for none
+ */
+void initInterruptController(InterruptController *controller, int const *priority, unsigned int hostMask, int vectorTable) {
+    memset(controller, 0, sizeof(*controller));
+
+    for (int source = 0; source < IRQ_SOURCES; source++) {
+        controller->rank[source] = -1;
+        controller->source[source] = -1;
+    }
+
+    for (int source = 0; source < IRQ_SOURCES; source++) {
+        int rank = priority[source];
+        if (rank < 0 || rank >= IRQ_SOURCES || controller->source[rank] != -1)
+            errorExit("interrupt priorities must be a permutation of 0-3");
+
+        controller->rank[source] = rank;
+        controller->source[rank] = source;
+    }
+
+    controller->vectorTable = vectorTable;
+    controller->hostMask = sourceBitsToRanks(controller, hostMask);
+    controller->synchronous = sourceBitsToRanks(controller, (1u << IRQ_FAULT) | (1u << IRQ_SYSCALL));
+    controller->edgeTriggered = sourceBitsToRanks(controller, 1u << IRQ_TIMER);
+
+    // device completion has no handler without a vector table
+    if (vectorTable == 0)
+        controller->hostMask |= sourceBitsToRanks(controller, 1u << IRQ_DEVICE);
+
+    controller->mask = controller->hostMask;
+    updateInterruptEnable(controller);
+} /* end */
+
+/**
+ * Sets up an empty calling context tree with one root per process
+ * 
+ * @param profiler to initialize
+ * @param period instructions between samples
+ * @param processCount number of processes (shadow stacks)
+ */
+void initProfiler(Profiler *profiler, int period, int processCount) {
+    memset(profiler, 0, sizeof(*profiler));
+    profiler->period = period;
+    profiler->countdown = period;
+    profiler->processCount = processCount;
+
+    profiler->bucketCount = 1024;
+    profiler->buckets = malloc(profiler->bucketCount * sizeof(int));
+    profiler->nodeCapacity = processCount + 1024;
+    profiler->nodes = malloc(profiler->nodeCapacity * sizeof(ProfileNode));
+    profiler->stacks = calloc(processCount, sizeof(ProfileStack));
+    if (profiler->buckets == NULL || profiler->nodes == NULL || profiler->stacks == NULL)
+        errorExit("malloc() failed");
+
+    memset(profiler->buckets, -1, profiler->bucketCount * sizeof(int));
+
+    // roots aren't hashed, node pid is the root of process pid
+    for (int pid = 0; pid < processCount; pid++) {
+        profiler->nodes[pid].parent = -1;
+        profiler->nodes[pid].frame = pid;
+        profiler->nodes[pid].samples = 0;
+        profiler->nodes[pid].next = -1;
+        profiler->stacks[pid].node = pid;
+    }
+    profiler->nodeCount = processCount;
+} /* end */
+
+/**
+ * Sets starting registers for every process and queues them all as ready
+ * 
+ * @param scheduler to initialize
+ * @param policy round robin, priority, or lottery
+ * @param table process table, priorities and file names already set
+ * @param count number of processes in table
+ */
+void initScheduler(Scheduler *scheduler, SchedulerPolicy policy, ProcessControlBlock *table, int count) {
+    memset(scheduler, 0, sizeof(*scheduler));
+    scheduler->policy = policy;
+    scheduler->table = table;
+    scheduler->processCount = count;
+    scheduler->liveCount = count;
+    scheduler->lotterySeed = (unsigned int)time(NULL) | 1u;
+
+    for (int pid = 0; pid < count; pid++) {
+        // SP set to 1000
+        table[pid].PC = 0;
+        table[pid].SP = getMaxUserProgramEntry() + 1;
+        enqueueProcess(scheduler, pid);
+    }
+} /* end */
+
+/**
+ * Reloads the guest interrupt mask, word [IRQ_SOURCES] of the vector table
+ * A set bit (1 << IRQ_*) masks that source, on top of the host mask
+ * 
+ * @param controller interrupt state
+ * @param bus memory access for the CPU
+ */
+void loadInterruptMask(InterruptController *controller, MemoryBus *bus) {
+    controller->mask = controller->hostMask;
+
+    if (controller->vectorTable != 0) {
+        controller->mask |= sourceBitsToRanks(controller, readMemory(bus, controller->vectorTable + IRQ_SOURCES));
+    }
+
+    updateInterruptEnable(controller);
+} /* end */
+
+/**
+ * Sets the dirty bits of the image pages a write covers
+ * 
+ * @param bus memory access for the CPU, with an image and a dirty page bitmap
+ * @param first lowest address written, in the current partition
+ * @param count words written, at least 1
+ */
+void markDirtyPages(MemoryBus *bus, int first, int count) {
+    size_t offset = (size_t)(bus->partition - bus->image) + first;
+    for (size_t page = offset / PAGE_WORDS; page <= (offset + count - 1) / PAGE_WORDS; page++)
+        bus->dirtyPages[page / 32] |= 1u << (page % 32);
+} /* end */
+
+/**
+ * Adds one process's counts to another's; every field is counted by only one side, 
+ * or is a sum over both (transport calls are kept apart per side)
+ * 
+ * @param into counts to add to
+ * @param from counts to add
+ */
+void mergeMetrics(Metrics *into, Metrics const *from) {
+    into->instructions += from->instructions;
+    into->kernelInstructions += from->kernelInstructions;
+    into->memoryReads += from->memoryReads;
+    into->memoryWrites += from->memoryWrites;
+    for (int source = 0; source < IRQ_SOURCES; source++)
+        into->interrupts[source] += from->interrupts[source];
+    into->syscalls += from->syscalls;
+    into->cpuTransportCalls += from->cpuTransportCalls;
+    into->memoryTransportCalls += from->memoryTransportCalls;
+    into->elapsedNs += from->elapsedNs;
+} /* end */
+
+/**
+ * Opens host counters for the calling process, counting from now on
+ * Counters the kernel refuses (no PMU, perf_event_paranoid, not Linux) stay unsupported
+ * 
+ * @param counters fd and supported bits are set here
+ */
+void openPerfCounters(PerfCounters *counters) {
+    memset(counters, 0, sizeof(*counters));
+
+#ifdef __linux__
+    static struct { unsigned int type; unsigned long long config; } const events[PERF_COUNTERS] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS }
+    };
+
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // user mode only, so hardware counters open with perf_event_paranoid at 2
+        attr.exclude_kernel = events[i].type == PERF_TYPE_HARDWARE;
+        attr.exclude_hv = 1;
+
+        counters->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (counters->fd[i] != -1)
+            counters->supported |= 1u << i;
+    }
+#else
+    for (int i = 0; i < PERF_COUNTERS; i++)
+        counters->fd[i] = -1;
+#endif
+} /* end */
+
+/**
+ * Reads interrupt priorities from the command line, in source order
+ * (fault,syscall,timer,device), e.g. "0,1,3,2"
+ * 
+ * @param list comma separated ranks
+ * @param priority rank for each source
+ */
+void parseInterruptPriorities(char const *list, int *priority) {
+    char const *c = list;
+    for (int source = 0; source < IRQ_SOURCES; source++) {
+        if (*c < '0' || *c > '9')
+            errorExit("interrupt priorities must be 4 numbers (fault,syscall,timer,device)");
+
+        priority[source] = atoi(c);
+        while (*c >= '0' && *c <= '9') {
+            c += 1;
+        }
+        if (*c == ',')
+            c += 1;
+    }
+} /* end */
+
+/**
+ * Write read status and ptr to memory
+ * 
+ * @param cpuToMemory pipe
+ * @param ptr value at address that will be read
+ * @param readStatus inform memory of status
+ */
+void pipeReadStatusAndPTR(int *cpuToMemory, Word ptr, Word readStatus) {
+    if (write(cpuToMemory[1], &readStatus, sizeof(readStatus)) == -1)
+        errorExit("write() failed");
+    
+    if (write(cpuToMemory[1], &ptr, sizeof(ptr)) == -1)
+        errorExit("write() failed");
+} /* end */
+
+/**
+ * Pipe a fetch request (status and address) to memory process with one write
+ * 
+ * @param cpuToMemory pipe
+ * @param ptr first of the two words to fetch
+ */
+void pipeFetchRequest(int *cpuToMemory, Word ptr) {
+    Word request[2] = { getFetchStatus(), ptr };
+    if (write(cpuToMemory[1], request, sizeof(request)) == -1)
+        errorExit("fetch request, cpu to memory write() failed");
+} /* end */
+
+/**
+ * Pipe write status, address, value to memory process
+ * 
+ * @param cpuToMemory pipe
+ * @param writeStatus inform memory of status
+ * @param ptr address to write to
+ * @param value value to write to address (ptr)
+ */
+void pipeAddressToStack(int *cpuToMemory, Word writeStatus, Word ptr, Word value) {
+    if (write(cpuToMemory[1], &writeStatus, sizeof(writeStatus)) == -1)
+        errorExit("status, cpu to memory write() failed");
+
+    if (write(cpuToMemory[1], &ptr, sizeof(ptr)) == -1)
+        errorExit("ptr, cpu to memory write() failed");
+
+    if (write(cpuToMemory[1], &value, sizeof(value)) == -1)
+        errorExit("value, cpu to memory write() failed");
+} /* end */
+
+/**
+ * Pipe a block request (status and three words) to memory process with one write
+ * 
+ * @param cpuToMemory pipe
+ * @param status copy or fill
+ * @param first source or destination address
+ * @param second destination address or count
+ * @param third count or value
+ */
+void pipeBlockRequest(int *cpuToMemory, Word status, Word first, Word second, Word third) {
+    Word request[4] = { status, first, second, third };
+    if (write(cpuToMemory[1], request, sizeof(request)) == -1)
+        errorExit("block request, cpu to memory write() failed");
+} /* end */
+
+/**
+ * Pipe a status value alone to memory process (exit or reload signal)
+ * 
+ * @param cpuToMemory pipe
+ * @param status inform memory of status
+ */
+void pipeStatus(int *cpuToMemory, Word status) {
+    if (write(cpuToMemory[1], &status, sizeof(status)) == -1)
+        errorExit("status, cpu to memory write() failed");
+} /* end */
+
+/**
+ * Pops call frames (not interrupts) whose return address slot is below SP
+ * Keeps the shadow stack in step with SP when a program adjusts its stack directly
+ * 
+ * @param stack shadow call stack
+ * @param SP lowest live stack address
+ */
+void popProfileFrames(ProfileStack *stack, int SP) {
+    while (stack->depth > 0 && !stack->frames[stack->depth - 1].interrupt && 
+           stack->frames[stack->depth - 1].SP < SP) {
+        stack->depth -= 1;
+        stack->node = stack->frames[stack->depth].parent;
+    }
+} /* end */
+
+/**
+ * Sends a fetch for the words at ptr and ptr + 1 without waiting for the reply
+ * Does nothing with the in-process image, or when a line for ptr is already fetched or pending
+ * 
+ * @param bus memory access for the CPU
+ * @param ptr predicted address of an instruction, any value
+ */
+void prefetchMemory(MemoryBus *bus, Word ptr) {
+    if (bus->image != NULL || (UWord)ptr >= PARTITION_WORDS)
+        return;
+
+    for (int i = 0; i < FETCH_LINES; i++) {
+        if ((bus->fetchLines[i].valid || bus->fetchLines[i].pending) && bus->fetchLines[i].address == ptr)
+            return;
+    }
+
+    // the line in use keeps the operand of the running instruction; one fetch is pending at most
+    collectFetch(bus);
+    FetchLine *line = &bus->fetchLines[(bus->fetchCurrent + 1) % FETCH_LINES];
+    bus->transportCalls += 1;
+    pipeFetchRequest(bus->cpuToMemory, ptr);
+    line->address = ptr;
+    line->valid = false;
+    line->pending = true;
+} /* end */
+
+/**
+ * Prints host counters for the CPU and memory processes, and guest MIPS, to stderr
+ * 
+ * @param cpu counters for the CPU process
+ * @param memory counters for the memory process
+ * @param scheduler holds the process table (guest instruction counts)
+ * @param elapsedNs wall time of the run
+ */
+void printPerfReport(PerfCounters const *cpu, PerfCounters const *memory, Scheduler *scheduler, long elapsedNs) {
+    static char const *counterNames[PERF_COUNTERS] = { 
+        "cycles", "instructions", "branch-misses", "cache-misses", 
+        "task-clock ms", "context-switches", "cpu-migrations", "page-faults" 
+    };
+    char cpuCell[32], memoryCell[32];
+
+    fprintf(stderr, "\n%-18s %16s %16s\n", "counter", "cpu process", "memory process");
+
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        fprintf(stderr, "%-18s %16s %16s\n", counterNames[i], 
+            formatPerfCounter(cpu, i, cpuCell), formatPerfCounter(memory, i, memoryCell));
+    }
+
+    long instructions = 0;
+    for (int pid = 0; pid < scheduler->processCount; pid++)
+        instructions += scheduler->table[pid].timer;
+
+    double mips = 0;
+    if (elapsedNs > 0)
+        mips = instructions * 1e3 / elapsedNs;
+
+    fprintf(stderr, "guest instructions: %ld, wall time: %.3f ms, guest MIPS: %.3f", 
+        instructions, elapsedNs / 1e6, mips);
+
+    // host instructions per guest instruction, when both processes could count them
+    if (instructions > 0 && (cpu->supported & memory->supported & (1u << PERF_INSTRUCTIONS))) 
+        fprintf(stderr, ", host instructions per guest instruction: %.1f", 
+            (double)(cpu->value[PERF_INSTRUCTIONS] + memory->value[PERF_INSTRUCTIONS]) / instructions);
+    fprintf(stderr, "\n");
+} /* end */
+
+/**
+ * Prints how a run ended and what it used, for runs with limits
+ * 
+ * @param status from cpuProcess
+ * @param metrics what the run did
+ */
+void printRunReport(RunStatus status, Metrics const *metrics) {
+    fprintf(stderr, "\nrun: %s, %ld instructions, %ld memory accesses, %.3f ms\n", runStatusMessage(status), 
+        metrics->instructions, metrics->memoryReads + metrics->memoryWrites, metrics->elapsedNs / 1e6);
+} /* end */
+
+/**
+ * Prints per-process and scheduler statistics (stderr, so program output stays clean)
+ * 
+ * @param scheduler holds the process table
+ */
+void printSchedulerReport(Scheduler *scheduler) {
+    static char const *policyNames[] = { "rr", "priority", "lottery" };
+
+    fprintf(stderr, "\n%-4s %-24s %8s %14s %12s %9s\n",
+        "pid", "file", "priority", "instructions", "cpu time ms", "switches");
+
+    for (int pid = 0; pid < scheduler->processCount; pid++) {
+        ProcessControlBlock *process = &scheduler->table[pid];
+        fprintf(stderr, "%-4d %-24s %8d %14ld %12.3f %9ld\n",
+            pid, process->fileName, process->priority, process->timer,
+            process->cpuTimeNs / 1e6, process->contextSwitches);
+    }
+
+    double meanLatency = 0;
+    if (scheduler->contextSwitches > 0)
+        meanLatency = (double)scheduler->switchLatencyNs / scheduler->contextSwitches;
+
+    fprintf(stderr, "scheduler: %s, context switches: %ld, mean switch latency: %.0f ns\n",
+        policyNames[scheduler->policy], scheduler->contextSwitches, meanLatency);
+} /* end */
+
+/**
+ * Read file (integer values) into memory array
+ * 
+ * @param file is file name
+ * @param memory is memory array
+ * @return NULL, or what is wrong with the file
+ */
+char *processFileInput(FILE *file, Word *memory) {
+    char line[256];
+    Word i = 0;
+
+    /*
+        If line begins with a period, change loader address (index value).
+        Ignore any line that starts with a newline character or space
+        Keep only integer values on line and store into memory array.
+    */
+    while (fgets(line, sizeof(line), file)) {
+        if (strchr(line, '\n') == NULL && getc(file) != EOF)
+            return "line too long";
+        if (line[0] == '.') {
+            char *changeLoadAddress = line + 1;
+            i = preprocessLine(changeLoadAddress);
+        }
+        else if (line[0] != '\n' && line[0] != ' ') {
+            if ((UWord)i >= PARTITION_WORDS)
+                return "load address out of range";
+            memory[i] = preprocessLine(line);
+            i += 1;
+        }
+    }
+    return NULL;
+} /* end */
+
+/**
+ * Read a binary image (written by cpu_mem_asm -b) into memory array
+ * 
+ * @param file positioned after IMAGE_MAGIC
+ * @param memory is memory array
+ * @return NULL, or what is wrong with the image
+ */
+char *processImageInput(FILE *file, Word *memory) {
+    Word header[2];
+
+    // (address, count) then count words, until end of file
+    while (fread(header, sizeof(Word), 2, file) == 2) {
+        if (header[0] < 0 || header[0] > PARTITION_WORDS || header[1] < 0 || header[1] > PARTITION_WORDS - header[0])
+            return "image segment out of range";
+        if (fread(memory + header[0], sizeof(Word), header[1], file) != (size_t)header[1])
+            return "image is truncated";
+    }
+    return NULL;
+} /* end */
+
+/**
+ * Pushes a shadow frame for a call (case 23)
+ * Frames whose return address slot is at or below the new one were abandoned, so they are popped first
+ * 
+ * @param profiler shadow call stack of the running process
+ * @param target called address
+ * @param SP address of the return address just pushed
+ */
+void profileCall(Profiler *profiler, int target, int SP) {
+    popProfileFrames(profiler->stack, SP + 1);
+    pushProfileFrame(profiler, target, SP, false);
+} /* end */
+
+/**
+ * Pushes a shadow frame for an interrupt or system call
+ * 
+ * @param profiler shadow call stack of the running process
+ * @param source interrupt source
+ */
+void profileInterrupt(Profiler *profiler, int source) {
+    pushProfileFrame(profiler, -(source + 1), 0, true);
+} /* end */
+
+/**
+ * Pops shadow frames up to and including the innermost interrupt (case 30)
+ * 
+ * @param profiler shadow call stack of the running process
+ */
+void profileInterruptReturn(Profiler *profiler) {
+    ProfileStack *stack = profiler->stack;
+
+    while (stack->depth > 0) {
+        stack->depth -= 1;
+        stack->node = stack->frames[stack->depth].parent;
+        if (stack->frames[stack->depth].interrupt)
+            break;
+    }
+} /* end */
+
+/**
+ * Pops the shadow frame for a return (case 24)
+ * 
+ * @param profiler shadow call stack of the running process
+ * @param SP address of the return address being popped
+ */
+void profileReturn(Profiler *profiler, int SP) {
+    popProfileFrames(profiler->stack, SP + 1);
+} /* end */
+
+/**
+ * Pushes a shadow frame and moves to its calling context node
+ * 
+ * @param profiler shadow call stack of the running process
+ * @param frame callee address, or -(source + 1) for an interrupt
+ * @param SP address of the return address
+ * @param interrupt frame only pops on return from interrupt
+ */
+void pushProfileFrame(Profiler *profiler, int frame, int SP, bool interrupt) {
+    ProfileStack *stack = profiler->stack;
+
+    if (stack->depth == stack->capacity) {
+        stack->capacity = (stack->capacity == 0) ? 64 : stack->capacity * 2;
+        stack->frames = realloc(stack->frames, stack->capacity * sizeof(ProfileFrame));
+        if (stack->frames == NULL)
+            errorExit("realloc() failed");
+    }
+
+    stack->frames[stack->depth].parent = stack->node;
+    stack->frames[stack->depth].SP = SP;
+    stack->frames[stack->depth].interrupt = interrupt;
+    stack->depth += 1;
+    stack->node = profileNode(profiler, stack->node, frame);
+} /* end */
+
+/**
+ * Marks an interrupt pending
+ * 
+ * @param controller interrupt state
+ * @param source interrupt source
+ */
+void raiseInterrupt(InterruptController *controller, int source) {
+    controller->pending |= 1u << controller->rank[source];
+    controller->pending &= controller->enabled | ~controller->edgeTriggered;
+} /* end */
+
+/**
+ * Asks the memory process for its counts since it was last asked, and merges them in
+ * 
+ * @param cpuToMemory pipe
+ * @param memoryToCPU pipe
+ * @param metrics CPU side counts of the run, memory side counts are added
+ */
+void readMemoryMetrics(int *cpuToMemory, int *memoryToCPU, Metrics *metrics) {
+    Metrics memory;
+    pipeStatus(cpuToMemory, getMetricsStatus());
+    if (read(memoryToCPU[0], &memory, sizeof(memory)) != sizeof(memory))
+        errorExit("memory to cpu read() failed");
+
+    metrics->cpuTransportCalls += 2;
+    mergeMetrics(metrics, &memory);
+} /* end */
+
+/**
+ * Reads and closes host counters, and fills in the getrusage() fallbacks
+ * Counters the PMU multiplexed are scaled up by time enabled / time running
+ * 
+ * @param counters opened by openPerfCounters()
+ */
+void readPerfCounters(PerfCounters *counters) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if ((counters->supported & (1u << i)) == 0)
+            continue;
+
+        // value, time enabled, time running
+        unsigned long long data[3];
+        if (read(counters->fd[i], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+            counters->supported &= ~(1u << i);
+        else if (data[2] < data[1])
+            counters->value[i] = (unsigned long long)((double)data[0] * data[1] / data[2]);
+        else
+            counters->value[i] = data[0];
+
+        close(counters->fd[i]);
+        counters->fd[i] = -1;
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1)
+        errorExit("getrusage() failed");
+
+    counters->contextSwitches = usage.ru_nvcsw + usage.ru_nivcsw;
+    counters->cpuTimeNs = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000L + 
+                          (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000L;
+} /* end */
+
+/**
+ * Logs the old value of a word memory is about to write (memory process)
+ * 
+ * @param log undo log, the oldest entry overwritten once it is full
+ * @param memoryArray every partition
+ * @param address index into memoryArray
+ */
+void recordUndo(UndoLog *log, Word const *memoryArray, int address) {
+    UndoEntry *entry = &log->entries[log->count % log->capacity];
+    entry->address = address;
+    entry->value = memoryArray[address];
+    log->count += 1;
+} /* end */
+
+/**
+ * Doubles the calling context hash table
+ * 
+ * @param profiler calling context tree
+ */
+void rehashProfile(Profiler *profiler) {
+    profiler->bucketCount *= 2;
+    profiler->buckets = realloc(profiler->buckets, profiler->bucketCount * sizeof(int));
+    if (profiler->buckets == NULL)
+        errorExit("realloc() failed");
+
+    memset(profiler->buckets, -1, profiler->bucketCount * sizeof(int));
+    for (int node = profiler->processCount; node < profiler->nodeCount; node++) {
+        ProfileNode *entry = &profiler->nodes[node];
+        unsigned int bucket = ((unsigned int)entry->parent * 2654435761u ^ (unsigned int)entry->frame) & (profiler->bucketCount - 1);
+        entry->next = profiler->buckets[bucket];
+        profiler->buckets[bucket] = node;
+    }
+} /* end */
+
+/**
+ * Clears pending and in service interrupts (process switch)
+ * 
+ * @param controller interrupt state
+ */
+void resetInterruptController(InterruptController *controller) {
+    controller->pending = 0;
+    controller->depth = 0;
+    updateInterruptEnable(controller);
+} /* end */
+
+/**
+ * Puts the CPU side back to a snapshot and has memory undo every write made since
+ * Snapshots after it are dropped; the replay takes them again. The caller restores its locals
+ * 
+ * @param history snapshots and logs
+ * @param snapshot to go back to, already checked with isHistoryValid
+ * @param scheduler set to the snapshot's process table and ready queues
+ * @param controller set to the snapshot's interrupt state
+ * @param bus memory access for the CPU, its counters set to the snapshot's
+ */
+void restoreHistory(History *history, HistorySnapshot const *snapshot, Scheduler *scheduler, 
+                    InterruptController *controller, MemoryBus *bus) {
+    if (bus->writes > history->writeEnd)
+        history->writeEnd = bus->writes;
+
+    // no fetched line survives, since it may hold words the undo puts back
+    dropFetches(bus, 0, PARTITION_WORDS);
+    if (bus->writes > snapshot->writes)
+        pipeReadStatusAndPTR(bus->cpuToMemory, bus->writes - snapshot->writes, getUndoStatus());
+    switchPartition(bus, snapshot->current);
+
+    memcpy(scheduler->table, snapshot->table, scheduler->processCount * sizeof(ProcessControlBlock));
+    *scheduler = snapshot->scheduler;
+    *controller = snapshot->controller;
+    bus->reads = snapshot->reads;
+    bus->writes = snapshot->writes;
+    bus->transportCalls = snapshot->transportCalls;
+    history->randomCount = snapshot->randoms;
+
+    history->count = (int)(snapshot - history->snapshots - history->first + HISTORY_SNAPSHOTS) % HISTORY_SNAPSHOTS + 1;
+    history->nextSnapshot = snapshot->registers.executed + history->interval;
+} /* end */
+
+/**
+ * Puts back the old values of the last writes, newest first (memory process)
+ * 
+ * @param log undo log
+ * @param memoryArray every partition
+ * @param count writes to undo, no more than the log holds
+ */
+void rewindUndo(UndoLog *log, Word *memoryArray, long count) {
+    for (long i = 0; i < count && log->count > 0; i++) {
+        log->count -= 1;
+        UndoEntry const *entry = &log->entries[log->count % log->capacity];
+        memoryArray[entry->address] = entry->value;
+    }
+} /* end */
+
+/**
+ * Serves a resident simulator on a Unix socket until a client sends quit
+ * 
+ * The memory process stays up between runs. A client sends words in the program file format
+ * ('.address' lines move the load address, "program n" picks a partition), then "run".
+ * Staged words are compared with a copy of the resident image here, so only changed words
+ * reach the memory process. Before each run, memory reloads its pristine image (with patches)
+ * and the CPU starts over from the original process table and interrupt controller.
+ * Program output goes to the client, followed by a summary line. A run that stops on a guest
+ * error reports it to the client, and the next run starts from the reloaded image as usual.
+ * 
+ * @param socketPath Unix socket to listen on
+ * @param cpuToMemory is for piping from CPU to Memory
+ * @param memoryToCPU is for piping from Memory to CPU
+ * @param interrupt holds value for when to interrupt processing
+ * @param scheduler holds the process table, as set up by main
+ * @param controller interrupt controller, as set up by main
+ * @param limits budgets for each run (NULL for none)
+ * @param metricsExport where each run's metrics go (NULL for nowhere)
+ */
+void runDaemon(char const *socketPath, int *cpuToMemory, int *memoryToCPU, int interrupt, 
+               Scheduler *scheduler, InterruptController *controller, RunLimits *limits, 
+               MetricsExport const *metricsExport) {
+    int const partitionSize = getPartitionSize();
+    int const processCount = scheduler->processCount;
+    size_t const imageWords = (size_t)processCount * partitionSize;
+
+    // resident image, staged words, and which words are staged (bitmap and list)
+    Word *image = calloc(imageWords, sizeof(Word));
+    Word *staged = malloc(imageWords * sizeof(Word));
+    unsigned char *stagedBits = calloc(imageWords / 8 + 1, 1);
+    int *stagedList = malloc(imageWords * sizeof(int));
+    ProcessControlBlock *initialTable = malloc(processCount * sizeof(ProcessControlBlock));
+    if (image == NULL || staged == NULL || stagedBits == NULL || stagedList == NULL || initialTable == NULL)
+        errorExit("malloc() failed");
+
+    for (int pid = 0; pid < processCount; pid++)
+        validateFile(image + (size_t)pid * partitionSize, scheduler->table[pid].fileName);
+
+    memcpy(initialTable, scheduler->table, processCount * sizeof(ProcessControlBlock));
+    InterruptController initialController = *controller;
+    SchedulerPolicy policy = scheduler->policy;
+    MemoryBus bus = { cpuToMemory, memoryToCPU, NULL, NULL, NULL, 0, 0, 0, { { 0 } }, 0, NULL, NULL, NULL, NULL };
+    Metrics metrics;
+    int stagedCount = 0;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+        errorExit("daemon socket path too long");
+    strcpy(address.sun_path, socketPath);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == -1)
+        errorExit("socket() failed");
+
+    unlink(socketPath);
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listener, 4) == -1)
+        errorExit("daemon socket bind() failed");
+    fprintf(stderr, "daemon listening on %s\n", socketPath);
+
+    // a client that hangs up shows up as a write error, not a signal that ends the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    bool serving = true;
+    while (serving) {
+        int client = accept(listener, NULL, NULL);
+        if (client == -1)
+            errorExit("accept() failed");
+
+        // words staged by an earlier client don't carry over
+        for (int i = 0; i < stagedCount; i++)
+            stagedBits[stagedList[i] >> 3] &= ~(1u << (stagedList[i] & 7));
+        stagedCount = 0;
+
+        FILE *in = fdopen(client, "r");
+        FILE *out = fdopen(dup(client), "w");
+        if (in == NULL || out == NULL)
+            errorExit("fdopen() failed");
+
+        char line[256];
+        int pid = 0;
+        Word loadAddress = 0;
+
+        while (serving && fgets(line, sizeof(line), in)) {
+            if (strchr(line, '\n') == NULL && !feof(in)) {
+                fprintf(out, "line too long\n");
+                int c;
+                while ((c = getc(in)) != EOF && c != '\n')
+                    ;
+            }
+            else if (strncmp(line, "quit", 4) == 0) {
+                serving = false;
+            }
+            else if (strncmp(line, "program", 7) == 0) {
+                pid = atoi(line + 7);
+                loadAddress = 0;
+                if (pid < 0 || pid >= processCount) {
+                    fprintf(out, "program must be in [0, %d)\n", processCount);
+                    pid = 0;
+                }
+            }
+            else if (strncmp(line, "run", 3) == 0) {
+                // send only the words that differ from the resident image
+                int patched = 0;
+                int partition = -1;
+                for (int i = 0; i < stagedCount; i++) {
+                    int index = stagedList[i];
+                    stagedBits[index >> 3] &= ~(1u << (index & 7));
+                    if (image[index] == staged[index])
+                        continue;
+
+                    image[index] = staged[index];
+                    if (index / partitionSize != partition) {
+                        partition = index / partitionSize;
+                        pipeReadStatusAndPTR(cpuToMemory, partition, getSwitchStatus());
+                    }
+                    pipeAddressToStack(cpuToMemory, getPatchStatus(), index % partitionSize, staged[index]);
+                    patched += 1;
+                }
+                stagedCount = 0;
+                pipeStatus(cpuToMemory, getReloadStatus());
+
+                memcpy(scheduler->table, initialTable, processCount * sizeof(ProcessControlBlock));
+                initScheduler(scheduler, policy, scheduler->table, processCount);
+                *controller = initialController;
+
+                // program output goes to the client while it runs
+                struct timespec started, finished;
+                fflush(stdout);
+                int savedStdout = dup(STDOUT_FILENO);
+                dup2(client, STDOUT_FILENO);
+                clock_gettime(CLOCK_MONOTONIC, &started);
+
+                RunStatus status = cpuProcess(&bus, interrupt, scheduler, controller, limits, &metrics, NULL, NULL);
+
+                clock_gettime(CLOCK_MONOTONIC, &finished);
+                fflush(stdout);
+                clearerr(stdout);
+                dup2(savedStdout, STDOUT_FILENO);
+                close(savedStdout);
+
+                if (metricsExport != NULL) {
+                    readMemoryMetrics(cpuToMemory, memoryToCPU, &metrics);
+                    exportMetrics(metricsExport, scheduler, status, &metrics);
+                }
+
+                long instructions = 0;
+                for (int p = 0; p < processCount; p++)
+                    instructions += scheduler->table[p].timer;
+                if (status >= RUN_INVALID_OPCODE)
+                    fprintf(out, "\nERROR: %s\n", runStatusMessage(status));
+                else if (status != RUN_FINISHED)
+                    fprintf(out, "\nstopped: %s\n", runStatusMessage(status));
+                fprintf(out, "\nrun: %d words patched, %ld instructions, %.3f ms\n",
+                    patched, instructions, elapsedNanoseconds(&started, &finished) / 1e6);
+                pid = 0;
+                loadAddress = 0;
+            }
+            else if (line[0] == '.') {
+                loadAddress = preprocessLine(line + 1);
+            }
+            else if (line[0] != '\n' && line[0] != ' ') {
+                if (loadAddress < 0 || loadAddress >= partitionSize) {
+                    fprintf(out, "address " WORD_FORMAT " outside the partition\n", loadAddress);
+                    continue;
+                }
+
+                int index = pid * partitionSize + loadAddress;
+                staged[index] = preprocessLine(line);
+                if (!testAddressBit(stagedBits, index)) {
+                    stagedBits[index >> 3] |= 1u << (index & 7);
+                    stagedList[stagedCount++] = index;
+                }
+                loadAddress += 1;
+            }
+
+            // a client that went away ends its session, and the daemon goes back to accept
+            if (fflush(out) == EOF || ferror(out))
+                break;
+        }
+
+        fclose(in);
+        fclose(out);
+    }
+
+    close(listener);
+    unlink(socketPath);
+
+    free(initialTable);
+    free(stagedList);
+    free(stagedBits);
+    free(staged);
+    free(image);
+} /* end */
+
+/**
+ * Sets or clears a range of addresses in a bitmap
+ * 
+ * @param bitmap breakpoints or watchpoints
+ * @param first address, [0, PARTITION_WORDS)
+ * @param last address, inclusive
+ * @param value set (true) or clear (false)
+ */
+void setAddressBits(unsigned char *bitmap, int first, int last, bool value) {
+    for (int ptr = first; ptr <= last; ptr++) {
+        if (value)
+            bitmap[ptr >> 3] |= 1u << (ptr & 7);
+        else
+            bitmap[ptr >> 3] &= ~(1u << (ptr & 7));
+    }
+} /* end */
+
+/**
+ * Prints value in AC (either char or int)
+ * 
+ * @param port determines printing of int (1) or char (2)
+ * @param AC value in AC 
+ */
+void showAC(Word port, Word AC) {
+    if (port == 1) {
+        printf(WORD_FORMAT, AC);
+    }
+    if (port == 2) {
+        char charAC = AC;
+        printf("%c", charAC);
+    }
+} /* end */
+
+/**
+ * Points memory at a process's partition, in the memory process or in the image
+ * 
+ * @param bus memory access for the CPU
+ * @param pid index of the process (and its partition)
+ */
+void switchPartition(MemoryBus *bus, int pid) {
+    if (bus->image != NULL) {
+        bus->partition = bus->image + (size_t)pid * getPartitionSize();
+    }
+    else {
+        bus->transportCalls += 2;
+        pipeReadStatusAndPTR(bus->cpuToMemory, pid, getSwitchStatus());
+        dropFetches(bus, 0, PARTITION_WORDS);
+    }
+} /* end */
+
+/**
+ * Recomputes which sources can be taken now
+ * Called when the mask or the handlers in service change, never per instruction
+ * 
+ * @param controller interrupt state
+ */
+void updateInterruptEnable(InterruptController *controller) {
+    int highestInService = IRQ_SOURCES;
+    for (int i = 0; i < controller->depth; i++) {
+        if (controller->stack[i] < highestInService)
+            highestInService = controller->stack[i];
     }
+
+    unsigned int asynchronous = ((1u << highestInService) - 1) & ~controller->mask;
+    controller->enabled = asynchronous | controller->synchronous;
+    controller->pending &= controller->enabled | ~controller->edgeTriggered;
 } /* end */
 
 /**
@@ -1004,14 +3607,264 @@ void showAC(int port, int AC) {
  * @param memoryArray values stored in memory
  * @param fileName provided by user
  */
-void validateFile(int *memoryArray, char const *fileName) {
-    FILE *fp;
-    if ((fp = fopen(fileName, "r")) != NULL) {
-        processFileInput(fp, memoryArray);
-        fclose(fp);
-    } else {
+void validateFile(Word *memoryArray, char const *fileName) {
+    FILE *fp = fopen(fileName, "r");
+    if (fp == NULL)
         errorExit("File failed to open");
+
+    char *error = loadProgram(fp, memoryArray);
+    fclose(fp);
+    if (error != NULL)
+        errorExit(error);
+} /* end */
+
+/**
+ * Records a watchpoint hit for a block operation; a write hit wins over a read hit
+ * 
+ * @param bus memory access for the CPU
+ * @param from first address read
+ * @param readCount words read (0 if none)
+ * @param to first address written
+ * @param writeCount words written
+ */
+void watchMemoryRange(MemoryBus *bus, int from, int readCount, int to, int writeCount) {
+    if (bus->debugger == NULL)
+        return;
+
+    int hit = findAddressBit(bus->debugger->writeWatchpoints, to, writeCount);
+    if (hit >= 0) {
+        bus->debugger->watchHit = hit;
+        bus->debugger->watchWrite = true;
+        return;
+    }
+
+    hit = findAddressBit(bus->debugger->readWatchpoints, from, readCount);
+    if (hit >= 0) {
+        bus->debugger->watchHit = hit;
+        bus->debugger->watchWrite = false;
+    }
+} /* end */
+
+/**
+ * Writes value to address through the memory process (or the in-process image)
+ * Records a hit if the address is watched for writes
+ * 
+ * @param bus memory access for the CPU
+ * @param ptr address, already validated
+ * @param value value to write to address (ptr)
+ */
+void writeMemory(MemoryBus *bus, int ptr, Word value) {
+    bus->writes += 1;
+    if (bus->image != NULL) {
+        bus->partition[ptr] = value;
+        if (bus->dirtyPages != NULL)
+            markDirtyPages(bus, ptr, 1);
+    }
+    else {
+        bus->transportCalls += 3;
+        pipeAddressToStack(bus->cpuToMemory, getWriteStatus(), ptr, value);
+        dropFetches(bus, ptr, 1);
+    }
+
+    if (bus->debugger != NULL && testAddressBit(bus->debugger->writeWatchpoints, ptr)) {
+        bus->debugger->watchHit = ptr;
+        bus->debugger->watchWrite = true;
+    }
+} /* end */
+
+/**
+ * Appends one JSON line for a run; the line goes out in one write() to a file opened for
+ * appending, so runs writing the same file at once don't interleave
+ * 
+ * @param fileName JSON lines file
+ * @param scheduler holds the process table (file names)
+ * @param status how the run ended
+ * @param metrics what the run did
+ */
+void writeJsonMetrics(char const *fileName, Scheduler *scheduler, RunStatus status, Metrics const *metrics) {
+    char *line = NULL;
+    size_t length = 0;
+    FILE *fp = open_memstream(&line, &length);
+    if (fp == NULL)
+        errorExit("open_memstream() failed");
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    fprintf(fp, "{\"time\":%lld.%03ld,\"pid\":%d,\"files\":[", (long long)now.tv_sec, now.tv_nsec / 1000000, (int)getpid());
+    for (int pid = 0; pid < scheduler->processCount; pid++) {
+        if (pid > 0)
+            fputc(',', fp);
+        writeJsonString(fp, scheduler->table[pid].fileName);
+    }
+
+    fprintf(fp, "],\"status\":\"%s\",\"instructions\":%ld,\"user_instructions\":%ld,\"kernel_instructions\":%ld,", 
+            runStatusName(status), metrics->instructions, metrics->instructions - metrics->kernelInstructions, 
+            metrics->kernelInstructions);
+    fprintf(fp, "\"memory_reads\":%ld,\"memory_writes\":%ld,", metrics->memoryReads, metrics->memoryWrites);
+    fprintf(fp, "\"interrupts\":{\"fault\":%ld,\"syscall\":%ld,\"timer\":%ld,\"device\":%ld},\"syscalls\":%ld,",
+            metrics->interrupts[IRQ_FAULT], metrics->interrupts[IRQ_SYSCALL], metrics->interrupts[IRQ_TIMER],
+            metrics->interrupts[IRQ_DEVICE], metrics->syscalls);
+    fprintf(fp, "\"transport_calls\":{\"cpu\":%ld,\"memory\":%ld},\"elapsed_ns\":%ld}\n",
+            metrics->cpuTransportCalls, metrics->memoryTransportCalls, metrics->elapsedNs);
+    fclose(fp);
+
+    int fd = open(fileName, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1 || write(fd, line, length) != (ssize_t)length)
+        errorExit("metrics file failed to write");
+    close(fd);
+    free(line);
+} /* end */
+
+/**
+ * Writes a string as a JSON string, quoted and escaped
+ * 
+ * @param fp output
+ * @param s string to write
+ */
+void writeJsonString(FILE *fp, char const *s) {
+    fputc('"', fp);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(fp, "\\u%04x", *s);
+        else
+            fputc(*s, fp);
+    }
+    fputc('"', fp);
+} /* end */
+
+/**
+ * Writes collapsed stacks (one "root;frame;frame count" line per calling context) to a file
+ * and prints inclusive and exclusive instruction counts per frame to stderr
+ * 
+ * @param profiler calling context tree
+ * @param scheduler holds the process table (file names name the roots)
+ * @param fileName output file, readable by flamegraph tools
+ */
+void writeProfile(Profiler *profiler, Scheduler *scheduler, char const *fileName) {
+    FILE *fp = fopen(fileName, "w");
+    if (fp == NULL)
+        errorExit("profile file failed to open");
+
+    // frame table: call addresses, then interrupt sources, then top level
+    int const frameCount = PARTITION_WORDS + IRQ_SOURCES + 1;
+    long *inclusive = calloc(frameCount, sizeof(long));
+    long *exclusive = calloc(frameCount, sizeof(long));
+    int *seen = malloc(frameCount * sizeof(int));
+    int *path = malloc(profiler->nodeCount * sizeof(int));
+    if (inclusive == NULL || exclusive == NULL || seen == NULL || path == NULL)
+        errorExit("malloc() failed");
+    memset(seen, -1, frameCount * sizeof(int));
+
+    long total = 0;
+    char name[16];
+    char rootName[256];
+
+    for (int node = 0; node < profiler->nodeCount; node++) {
+        long samples = profiler->nodes[node].samples * profiler->period;
+        if (samples == 0)
+            continue;
+
+        int depth = 0;
+        for (int n = node; profiler->nodes[n].parent != -1; n = profiler->nodes[n].parent) {
+            path[depth] = n;
+            depth += 1;
+        }
+
+        int root = (depth == 0) ? node : profiler->nodes[path[depth - 1]].parent;
+        fprintf(fp, "%s", profileRootName(scheduler->table[profiler->nodes[root].frame].fileName, rootName, sizeof(rootName)));
+        for (int i = depth - 1; i >= 0; i--) {
+            int frame = profiler->nodes[path[i]].frame;
+            int index = (frame >= 0) ? frame : PARTITION_WORDS - frame - 1;
+
+            fprintf(fp, ";%s", profileFrameName(frame, name));
+
+            // recursion counts once toward inclusive
+            if (seen[index] != node) {
+                seen[index] = node;
+                inclusive[index] += samples;
+            }
+        }
+        fprintf(fp, " %ld\n", samples);
+
+        int top = (depth == 0) ? frameCount - 1 : profiler->nodes[node].frame;
+        exclusive[(top >= 0) ? top : PARTITION_WORDS - top - 1] += samples;
+        total += samples;
+    }
+    fclose(fp);
+
+    fprintf(stderr, "\n%-16s %14s %14s\n", "frame", "inclusive", "exclusive");
+    fprintf(stderr, "%-16s %14ld %14ld\n", "<top level>", total, exclusive[frameCount - 1]);
+    for (int index = 0; index < frameCount - 1; index++) {
+        if (inclusive[index] == 0)
+            continue;
+
+        profileFrameName((index < PARTITION_WORDS) ? index : PARTITION_WORDS - index - 1, name);
+        fprintf(stderr, "%-16s %14ld %14ld\n", name, inclusive[index], exclusive[index]);
     }
+
+    free(inclusive);
+    free(exclusive);
+    free(seen);
+    free(path);
+} /* end */
+
+/**
+ * Adds one run to the totals in a Prometheus text file, for a textfile collector to scrape
+ * 
+ * Runs that share the file take turns under a lock file (fileName.lock). The totals are read 
+ * back from the file, and the new file replaces it with rename(), so a scrape never sees half a file.
+ * 
+ * @param fileName Prometheus file
+ * @param status how the run ended
+ * @param metrics what the run did
+ */
+void writePrometheusMetrics(char const *fileName, RunStatus status, Metrics const *metrics) {
+    PrometheusSample samples[PROMETHEUS_SERIES];
+    int count = prometheusSamples(status, metrics, samples);
+
+    char lockName[4096], tempName[4096];
+    snprintf(lockName, sizeof(lockName), "%s.lock", fileName);
+    snprintf(tempName, sizeof(tempName), "%s.%d", fileName, (int)getpid());
+
+    int lock = open(lockName, O_RDWR | O_CREAT, 0644);
+    if (lock == -1 || flock(lock, LOCK_EX) == -1)
+        errorExit("metrics lock failed");
+
+    // add the totals so far; lines this build doesn't write are dropped
+    FILE *fp = fopen(fileName, "r");
+    if (fp != NULL) {
+        char line[256], series[128], name[128];
+        double value;
+        while (fgets(line, sizeof(line), fp)) {
+            if (line[0] == '#' || sscanf(line, "%127s %lf", series, &value) != 2)
+                continue;
+
+            for (int i = 0; i < count; i++) {
+                snprintf(name, sizeof(name), "%s%s", samples[i].name, samples[i].labels);
+                if (strcmp(name, series) == 0)
+                    samples[i].value += value;
+            }
+        }
+        fclose(fp);
+    }
+
+    fp = fopen(tempName, "w");
+    if (fp == NULL)
+        errorExit("metrics file failed to open");
+
+    for (int i = 0; i < count; i++) {
+        if (i == 0 || strcmp(samples[i].name, samples[i - 1].name) != 0) {
+            fprintf(fp, "# HELP %s %s\n", samples[i].name, samples[i].help);
+            fprintf(fp, "# TYPE %s counter\n", samples[i].name);
+        }
+        fprintf(fp, "%s%s %.17g\n", samples[i].name, samples[i].labels, samples[i].value);
+    }
+
+    if (fclose(fp) != 0 || rename(tempName, fileName) == -1)
+        errorExit("metrics file failed to write");
+    close(lock);
 } /* end */
 
 /**
@@ -1021,7 +3874,7 @@ void validateFile(int *memoryArray, char const *fileName) {
  * @param memoryArray values in memory
  * @param ptr value at this index written
  */
-void writeToCPU(int *memoryToCPU, int *memoryArray, int ptr) {
+void writeToCPU(int *memoryToCPU, Word *memoryArray, Word ptr) {
     if (write(memoryToCPU[1], &memoryArray[ptr], sizeof(memoryArray[ptr])) == -1)
         errorExit("memory to cpu write() failed");
-} /* end */
\ No newline at end of file
+} /* end */
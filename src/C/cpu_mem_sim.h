@@ -1,28 +1,469 @@
 #ifndef CPU_MEM_SIM_H_
 #define CPU_MEM_SIM_H_
 
-bool validateAddressAccess(int ptr, bool kernelMode);
-bool validateTimerInterrupt(int interrupt, int timer, bool kernelMode);
+// guest word width, picked at compile time (-DWORD_BITS=64); arithmetic wraps around
+#ifndef WORD_BITS
+#define WORD_BITS 32
+#endif
 
+#if WORD_BITS == 32
+typedef int32_t Word;
+typedef uint32_t UWord;
+#define WORD_FORMAT "%" PRId32
+#define WORD_MIN INT32_MIN
+#define UWORD_MAX UINT32_MAX
+#elif WORD_BITS == 64
+typedef int64_t Word;
+typedef uint64_t UWord;
+#define WORD_FORMAT "%" PRId64
+#define WORD_MIN INT64_MIN
+#define UWORD_MAX UINT64_MAX
+#else
+#error "WORD_BITS must be 32 or 64"
+#endif
+
+// overflow is defined for unsigned words, so these wrap around instead of being undefined
+#define WORD_ADD(a, b) ((Word)((UWord)(a) + (UWord)(b)))
+#define WORD_SUB(a, b) ((Word)((UWord)(a) - (UWord)(b)))
+#define WORD_MUL(a, b) ((Word)((UWord)(a) * (UWord)(b)))
+
+// priority levels for the scheduler, 0 is highest
+#define SCHEDULER_LEVELS 32
+
+// interrupt sources, also the default priority order (0 is highest)
+#define IRQ_FAULT 0
+#define IRQ_SYSCALL 1
+#define IRQ_TIMER 2
+#define IRQ_DEVICE 3
+#define IRQ_SOURCES 4
+#define IRQ_MAX_NESTING 16
+
+// words in one process partition (user program and system code)
+#define PARTITION_WORDS 2000
+
+// an in-process image can keep one dirty bit per page of this many words (a power of two), 
+// so putting it back after a run copies only the pages the run wrote
+#define PAGE_WORDS 64
+
+// binary images start with a 32-bit magic ("CMSI" or "CMSL" on little endian hosts) 
+// for the word width, then (address, count, words...) segments of words
+#define IMAGE_MAGIC_32 0x49534d43
+#define IMAGE_MAGIC_64 0x4c534d43
+#if WORD_BITS == 32
+#define IMAGE_MAGIC IMAGE_MAGIC_32
+#else
+#define IMAGE_MAGIC IMAGE_MAGIC_64
+#endif
+
+// host counters: four hardware counters, then software counters that don't need a PMU
+#define PERF_COUNTERS 8
+#define PERF_INSTRUCTIONS 1
+#define PERF_TASK_CLOCK 4
+#define PERF_CONTEXT_SWITCHES 5
+
+// guest control flow edges kept for fuzzing (a power of two)
+#define COVERAGE_EDGES 65536
+
+// instructions between watchdog checks of the run limits (the instruction budget is exact), and 
+// the most memory accesses one instruction can make, with an interrupt, outside block operations
+#define WATCHDOG_INSTRUCTIONS 1024
+#define WATCHDOG_ACCESSES 16
+
+// reverse execution (-R): snapshots and random numbers kept, and words of memory undo log by default
+#define HISTORY_SNAPSHOTS 1024
+#define HISTORY_UNDO_WORDS (1L << 20)
+#define HISTORY_RANDOMS 65536
+
+// how a run of cpuProcess ended; everything but RUN_FINISHED stops it early, 
+// the limits first, then errors a guest program can cause
+typedef enum RunStatus {
+    RUN_FINISHED,
+    RUN_INSTRUCTION_LIMIT,
+    RUN_TIME_LIMIT,
+    RUN_ACCESS_LIMIT,
+    RUN_INVALID_OPCODE,
+    RUN_MEMORY_FAULT,
+    RUN_DIVIDE_FAULT,
+    RUN_NESTING_LIMIT,
+    RUN_FRAME_FAULT,
+    RUN_VECTOR_FAULT
+} RunStatus;
+
+typedef enum SchedulerPolicy {
+    ROUND_ROBIN,
+    PRIORITY,
+    LOTTERY
+} SchedulerPolicy;
+
+// saved registers and accounting for one loaded program
+typedef struct ProcessControlBlock {
+    char const *fileName;
+    Word PC, SP, AC, X, Y;
+    long timer;
+    int priority;
+    int next;
+    bool kernelMode;
+    bool finished;
+    long contextSwitches;
+    long cpuTimeNs;
+} ProcessControlBlock;
+
+// ready queues are intrusive lists (ProcessControlBlock.next), one per priority level
+typedef struct Scheduler {
+    SchedulerPolicy policy;
+    ProcessControlBlock *table;
+    int processCount;
+    int liveCount;
+    int head[SCHEDULER_LEVELS];
+    int tail[SCHEDULER_LEVELS];
+    int levelCount[SCHEDULER_LEVELS];
+    unsigned int readyLevels;
+    unsigned int lotterySeed;
+    long contextSwitches;
+    long switchLatencyNs;
+} Scheduler;
+
+// breakpoint and watchpoint bitmaps hold one bit per address in a partition; with a history, 
+// travelTo is the instruction count a command asked to go back to (-1 for none), and a replay 
+// up to it doesn't stop at breakpoints or watchpoints
+typedef struct Debugger {
+    unsigned char breakpoints[PARTITION_WORDS / 8];
+    unsigned char readWatchpoints[PARTITION_WORDS / 8];
+    unsigned char writeWatchpoints[PARTITION_WORDS / 8];
+    int stepsLeft;
+    int watchHit;
+    bool watchWrite;
+    FILE *in;
+    FILE *out;
+    struct History *history;
+    long travelTo;
+    bool replaying;
+} Debugger;
+
+// calling context tree node; samples are exclusive to this context
+typedef struct ProfileNode {
+    int parent;
+    int frame;
+    int next;
+    long samples;
+} ProfileNode;
+
+typedef struct ProfileFrame {
+    int parent;
+    int SP;
+    bool interrupt;
+} ProfileFrame;
+
+// shadow call stack for one process, kept next to its SP
+typedef struct ProfileStack {
+    ProfileFrame *frames;
+    int depth;
+    int capacity;
+    int node;
+} ProfileStack;
+
+typedef struct Profiler {
+    int period;
+    int countdown;
+    int processCount;
+    ProfileNode *nodes;
+    int nodeCount;
+    int nodeCapacity;
+    int *buckets;
+    int bucketCount;
+    ProfileStack *stacks;
+    ProfileStack *stack;
+} Profiler;
+
+// counters for one host process; bit i of supported is set when counter i could be opened,
+// getrusage() figures stand in for the software counters the kernel refuses
+typedef struct PerfCounters {
+    int fd[PERF_COUNTERS];
+    unsigned long long value[PERF_COUNTERS];
+    unsigned int supported;
+    long contextSwitches;
+    long cpuTimeNs;
+} PerfCounters;
+
+// two words the CPU asked the memory process for in one request (pending until the reply is read); 
+// the reply to a request sent before a write holds the old words, so writes drop lines they hit
+#define FETCH_LINES 2
+typedef struct FetchLine {
+    Word address;
+    Word words[2];
+    bool valid;
+    bool pending;
+} FetchLine;
+
+// every read, write, and output the CPU makes goes through the bus; with an image, memory is 
+// in this process (partition points into image) and the pipes are unused; over the pipes,
+// the next instruction is fetched while this one runs (at most one line pending); 
+// output goes to stdout unless an output function is set; random numbers (case 8) come from 
+// randomSeed when it is set, so instances in one process don't share the C library's rand()
+typedef struct MemoryBus {
+    int *cpuToMemory;
+    int *memoryToCPU;
+    Debugger *debugger;
+    Word *image;
+    Word *partition;
+    long reads;
+    long writes;
+    long transportCalls;
+    FetchLine fetchLines[FETCH_LINES];
+    int fetchCurrent;
+    unsigned int *dirtyPages;
+    void (*output)(void *context, Word port, Word AC);
+    void *outputContext;
+    unsigned int *randomSeed;
+} MemoryBus;
+
+// budgets for one run of cpuProcess (0 is unlimited); a run with stop points also stops, once it 
+// has run an instruction, before a user mode fetch from an address set in them
+typedef struct RunLimits {
+    long instructions;
+    long wallNs;
+    long memoryAccesses;
+    struct timespec started;
+    unsigned char const *stopPoints;
+} RunLimits;
+
+// what one run did; each process counts into its own copy with plain adds (no atomics), and 
+// the memory process sends its copy when asked, so merging is adding the two field by field
+typedef struct Metrics {
+    long instructions;
+    long kernelInstructions;
+    long memoryReads;
+    long memoryWrites;
+    long interrupts[IRQ_SOURCES];
+    long syscalls;
+    long cpuTransportCalls;
+    long memoryTransportCalls;
+    long elapsedNs;
+} Metrics;
+
+// where metrics go: one JSON line per run, and totals over every run in Prometheus text format
+typedef struct MetricsExport {
+    char const *jsonFile;
+    char const *prometheusFile;
+} MetricsExport;
+
+// one series of the Prometheus file; labels include the braces, or are empty
+#define PROMETHEUS_SERIES 32
+typedef struct PrometheusSample {
+    char const *name;
+    char const *help;
+    char labels[32];
+    double value;
+} PrometheusSample;
+
+// saturating hit counters for (previous PC, PC) edges, hashed like AFL, and the edges hit so far 
+// (so clearing and comparing cost what a run touched, not the whole map); random numbers (case 8)
+// come from randomSeed, set for each run, instead of the clock
+typedef struct Coverage {
+    unsigned char *edges;
+    int *touched;
+    int touchedCount;
+    unsigned int previous;
+    unsigned int randomSeed;
+} Coverage;
+
+// register snapshot handed to the debugger; executed is how many instructions have run
+typedef struct Registers {
+    Word PC, SP, IR, AC, X, Y;
+    long timer;
+    bool kernelMode;
+    long executed;
+} Registers;
+
+// pending, enabled and mask bits are indexed by priority rank, so the highest
+// priority interrupt that can be taken is the lowest set bit of (pending & enabled)
+typedef struct InterruptController {
+    unsigned int pending;
+    unsigned int enabled;
+    unsigned int mask;
+    unsigned int hostMask;
+    unsigned int synchronous;
+    unsigned int edgeTriggered;
+    int rank[IRQ_SOURCES];
+    int source[IRQ_SOURCES];
+    int stack[IRQ_MAX_NESTING];
+    int depth;
+    int vectorTable;
+} InterruptController;
+
+// old value of one word memory wrote, by index into every partition
+typedef struct UndoEntry {
+    int address;
+    Word value;
+} UndoEntry;
+
+// the memory process's last capacity writes, oldest overwritten first; count is every write logged
+typedef struct UndoLog {
+    UndoEntry *entries;
+    long capacity;
+    long count;
+} UndoLog;
+
+// CPU state before an instruction; writes and randoms are how far the undo log and the random 
+// log had got, and table points at this snapshot's copy of the process table
+typedef struct HistorySnapshot {
+    Registers registers;
+    int current;
+    long nextTick;
+    bool reschedule;
+    long reads;
+    long writes;
+    long transportCalls;
+    long randoms;
+    Metrics counts;
+    Scheduler scheduler;
+    InterruptController controller;
+    ProcessControlBlock *table;
+} HistorySnapshot;
+
+// a snapshot every interval instructions (the oldest dropped first), and the random numbers drawn; 
+// going back restores a snapshot, rewinds memory, and runs forward again, drawing randoms from the 
+// log until randomCount reaches randomEnd and showing no output up to shownTo instructions; 
+// writeEnd is the most writes memory has logged, so older undo entries may be overwritten
+typedef struct History {
+    HistorySnapshot snapshots[HISTORY_SNAPSHOTS];
+    int first;
+    int count;
+    int interval;
+    long nextSnapshot;
+    long undoWords;
+    long writeEnd;
+    Word *randoms;
+    long randomCount;
+    long randomEnd;
+    long shownTo;
+} History;
+
+bool isHistoryValid(History *history, MemoryBus *bus, HistorySnapshot const *snapshot);
+bool isNumber(char const *s);
+bool raiseFault(InterruptController *controller, MemoryBus *bus);
+bool testAddressBit(unsigned char const *bitmap, int ptr);
+bool validateAddressAccess(Word ptr, bool kernelMode);
+bool validateAddressRange(Word first, Word count, bool kernelMode);
+
+int findAddressBit(unsigned char const *bitmap, int first, int count);
+int getCopyStatus();
+int getExitStatus();
+int getFetchStatus();
+int getFillStatus();
 int getMaxSystemCodeEntry();
 int getMaxUserProgramEntry();
+int getMetricsStatus();
+int getPartitionSize();
+int getPatchStatus();
 int getReadStatus();
+int getReloadStatus();
+int getSwitchStatus();
+int getUndoStatus();
 int getWriteStatus();
-int preprocessLine(char *line);
+int instructionWords(Word IR);
+int interruptVector(InterruptController *controller, MemoryBus *bus, int source);
+int nextInterrupt(InterruptController *controller);
+int pickNextProcess(Scheduler *scheduler);
 int randomInteger(int n);
-int readFromCPU(int *cpuToMemory);
-int readFromMemory(int *memoryToCPU);
-int timerInterrupt(int *cpuToMemory, int SP, int PC, int tempSP);
+int profileNode(Profiler *profiler, int parent, int frame);
+int prometheusSamples(RunStatus status, Metrics const *metrics, PrometheusSample *samples);
+int splitPriority(char *fileName);
+
+Word historyRandom(History *history, int n);
+Word predictNextPC(MemoryBus *bus, Word IR, Word PC, Word AC);
+Word preprocessLine(char *line);
+Word readMemory(MemoryBus *bus, int ptr);
+Word readFromCPU(int *cpuToMemory);
+Word readFromMemory(int *memoryToCPU);
+
+unsigned int nextRandom(unsigned int *seed);
+unsigned int sourceBitsToRanks(InterruptController *controller, unsigned int sourceBits);
+
+char *formatPerfCounter(PerfCounters const *counters, int counter, char *cell);
+char *loadProgram(FILE *fp, Word *memory);
+char *processFileInput(FILE *fp, Word *memory);
+char *processImageInput(FILE *file, Word *memory);
+char *profileFrameName(int frame, char *name);
+char *profileRootName(char const *fileName, char *name, size_t size);
+char *runStatusMessage(RunStatus status);
+char *runStatusName(RunStatus status);
+
+long elapsedNanoseconds(struct timespec *start, struct timespec *end);
+long historyStart(History *history, MemoryBus *bus);
+
+HistorySnapshot *findHistorySnapshot(History *history, MemoryBus *bus, long executed);
+HistorySnapshot *saveHistory(History *history, Scheduler const *scheduler, InterruptController const *controller, 
+                             MemoryBus const *bus);
+
+RunStatus checkRunLimits(RunLimits *limits, MemoryBus *bus, long executed, long *nextCheck);
+RunStatus cpuProcess(MemoryBus *bus, int interrupt, Scheduler *scheduler, InterruptController *controller, 
+                     RunLimits *limits, Metrics *metrics, Profiler *profiler, Coverage *coverage);
+RunStatus enterInterrupt(InterruptController *controller, MemoryBus *bus, int source, int vector, Word *SP, Word *PC);
+
+SchedulerPolicy parseSchedulerPolicy(char const *name);
 
 void closePipes(int *cpuToMemory, int *memoryToCPU, int cpuInt, int memoryInt);
-void cpuProcess(int *cpuToMemory, int *memoryToCPU, int interrupt);
+void collectFetch(MemoryBus *bus);
+void copyMemory(MemoryBus *bus, int from, int to, int count);
+void debugPrompt(Debugger *debugger, MemoryBus *bus, int pid, Registers *registers);
+void dropFetches(MemoryBus *bus, int first, int count);
+void enqueueProcess(Scheduler *scheduler, int pid);
 void errorExit(char *s);
-void memoryProcess(int *cpuToMemory, int *memoryToCPU, char const *fileName);
-void pipeAddressToStack(int *cpuToMemory, int writeStatus, int SP, int PC);
-void pipeReadStatusAndPTR(int *cpuToMemory, int PC, int readStatus);
-void processFileInput(FILE *fp, int *memory);
-void showAC(int port, int AC);
-void validateFile(int *memoryArray, char const *fileName);
-void writeToCPU(int *memoryToCPU, int *memoryArray, int ptr);
-
-#endif
\ No newline at end of file
+void exitInterrupt(InterruptController *controller, MemoryBus *bus);
+void exportMetrics(MetricsExport const *metricsExport, Scheduler *scheduler, RunStatus status, Metrics const *metrics);
+void fillMemory(MemoryBus *bus, int to, int count, Word value);
+void freeHistory(History *history);
+void freeProfiler(Profiler *profiler);
+void initDebugger(Debugger *debugger, char const *socketPath);
+void initHistory(History *history, int interval, long undoWords, int processCount);
+void initInterruptController(InterruptController *controller, int const *priority, unsigned int hostMask, int vectorTable);
+void initProfiler(Profiler *profiler, int period, int processCount);
+void initScheduler(Scheduler *scheduler, SchedulerPolicy policy, ProcessControlBlock *table, int count);
+void loadInterruptMask(InterruptController *controller, MemoryBus *bus);
+void markDirtyPages(MemoryBus *bus, int first, int count);
+void memoryProcess(int *cpuToMemory, int *memoryToCPU, char const **fileNames, int fileCount, PerfCounters *counters,
+                   bool resident, long undoWords);
+void mergeMetrics(Metrics *into, Metrics const *from);
+void openPerfCounters(PerfCounters *counters);
+void parseInterruptPriorities(char const *list, int *priority);
+void pipeAddressToStack(int *cpuToMemory, Word writeStatus, Word ptr, Word value);
+void pipeBlockRequest(int *cpuToMemory, Word status, Word first, Word second, Word third);
+void pipeFetchRequest(int *cpuToMemory, Word ptr);
+void pipeReadStatusAndPTR(int *cpuToMemory, Word ptr, Word readStatus);
+void pipeStatus(int *cpuToMemory, Word status);
+void popProfileFrames(ProfileStack *stack, int SP);
+void prefetchMemory(MemoryBus *bus, Word ptr);
+void printPerfReport(PerfCounters const *cpu, PerfCounters const *memory, Scheduler *scheduler, long elapsedNs);
+void printRunReport(RunStatus status, Metrics const *metrics);
+void printSchedulerReport(Scheduler *scheduler);
+void profileCall(Profiler *profiler, int target, int SP);
+void profileInterrupt(Profiler *profiler, int source);
+void profileInterruptReturn(Profiler *profiler);
+void profileReturn(Profiler *profiler, int SP);
+void pushProfileFrame(Profiler *profiler, int frame, int SP, bool interrupt);
+void raiseInterrupt(InterruptController *controller, int source);
+void readMemoryMetrics(int *cpuToMemory, int *memoryToCPU, Metrics *metrics);
+void readPerfCounters(PerfCounters *counters);
+void recordUndo(UndoLog *log, Word const *memoryArray, int address);
+void rehashProfile(Profiler *profiler);
+void resetInterruptController(InterruptController *controller);
+void restoreHistory(History *history, HistorySnapshot const *snapshot, Scheduler *scheduler, 
+                    InterruptController *controller, MemoryBus *bus);
+void rewindUndo(UndoLog *log, Word *memoryArray, long count);
+void runDaemon(char const *socketPath, int *cpuToMemory, int *memoryToCPU, int interrupt, 
+               Scheduler *scheduler, InterruptController *controller, RunLimits *limits, MetricsExport const *metricsExport);
+void setAddressBits(unsigned char *bitmap, int first, int last, bool value);
+void showAC(Word port, Word AC);
+void switchPartition(MemoryBus *bus, int pid);
+void updateInterruptEnable(InterruptController *controller);
+void validateFile(Word *memoryArray, char const *fileName);
+void watchMemoryRange(MemoryBus *bus, int from, int readCount, int to, int writeCount);
+void writeMemory(MemoryBus *bus, int ptr, Word value);
+void writeJsonMetrics(char const *fileName, Scheduler *scheduler, RunStatus status, Metrics const *metrics);
+void writeJsonString(FILE *fp, char const *s);
+void writeProfile(Profiler *profiler, Scheduler *scheduler, char const *fileName);
+void writePrometheusMetrics(char const *fileName, RunStatus status, Metrics const *metrics);
+void writeToCPU(int *memoryToCPU, Word *memoryArray, Word ptr);
+
+#endif